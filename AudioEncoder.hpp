@@ -0,0 +1,348 @@
+#pragma once
+
+#include "HTMHelper.hpp"
+#include "Utils.hpp"
+#include "Parallel.hpp"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Read-only memory mapped WAV file. Supports 16 bit PCM and 32 bit float
+//samples. Multi channel files are mixed down to mono when read.
+class WavFile
+{
+public:
+	WavFile(const std::string& path)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+			throw std::runtime_error("WavFile: cannot open " + path);
+		struct stat st;
+		if(fstat(fd, &st) != 0) {
+			close(fd);
+			throw std::runtime_error("WavFile: cannot stat " + path);
+		}
+		file_size = st.st_size;
+		void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if(ptr == MAP_FAILED)
+			throw std::runtime_error("WavFile: cannot mmap " + path);
+		madvise(ptr, file_size, MADV_SEQUENTIAL);
+		mapped = (const uint8_t*)ptr;
+
+		try {
+			parseHeader();
+		}
+		catch(...) {
+			munmap((void*)mapped, file_size);
+			throw;
+		}
+	}
+
+	~WavFile()
+	{
+		munmap((void*)mapped, file_size);
+	}
+
+	WavFile(const WavFile&) = delete;
+	WavFile& operator= (const WavFile&) = delete;
+
+	//Decodes up to count (mono) frames starting at frame start into out.
+	//Returns the number of frames actually read
+	size_t read(size_t start, size_t count, float* out) const
+	{
+		if(start >= num_frames)
+			return 0;
+		count = std::min(count, num_frames-start);
+		size_t frame_bytes = num_channels*bytes_per_sample;
+		const uint8_t* p = samples + start*frame_bytes;
+		for(size_t i=0;i<count;i++) {
+			float s = 0;
+			for(size_t c=0;c<num_channels;c++) {
+				if(is_float) {
+					float v;
+					std::memcpy(&v, p, sizeof(v));
+					s += v;
+				}
+				else {
+					int16_t v;
+					std::memcpy(&v, p, sizeof(v));
+					s += v/32768.f;
+				}
+				p += bytes_per_sample;
+			}
+			out[i] = s/num_channels;
+		}
+		return count;
+	}
+
+	size_t sampleRate() const {return sample_rate;}
+	size_t numChannels() const {return num_channels;}
+	size_t numFrames() const {return num_frames;}
+
+protected:
+	void parseHeader()
+	{
+		if(file_size < 12 || std::memcmp(mapped, "RIFF", 4) != 0 || std::memcmp(mapped+8, "WAVE", 4) != 0)
+			throw std::runtime_error("WavFile: not a RIFF/WAVE file");
+
+		bool has_fmt = false;
+		size_t pos = 12;
+		while(pos+8 <= file_size) {
+			const uint8_t* chunk = mapped+pos;
+			uint32_t chunk_size = readLE<uint32_t>(chunk+4);
+			const uint8_t* body = chunk+8;
+			size_t body_size = std::min<size_t>(chunk_size, file_size-pos-8);
+
+			if(std::memcmp(chunk, "fmt ", 4) == 0) {
+				if(body_size < 16)
+					throw std::runtime_error("WavFile: fmt chunk too small");
+				uint16_t format = readLE<uint16_t>(body);
+				num_channels = readLE<uint16_t>(body+2);
+				sample_rate = readLE<uint32_t>(body+4);
+				uint16_t bits = readLE<uint16_t>(body+14);
+				if(format == 1 && bits == 16)
+					is_float = false;
+				else if(format == 3 && bits == 32)
+					is_float = true;
+				else
+					throw std::runtime_error("WavFile: only 16 bit PCM and 32 bit float are supported, but get format "
+						+ std::to_string(format) + " with " + std::to_string(bits) + " bits");
+				if(num_channels == 0)
+					throw std::runtime_error("WavFile: file has no channels");
+				bytes_per_sample = bits/8;
+				has_fmt = true;
+			}
+			else if(std::memcmp(chunk, "data", 4) == 0) {
+				if(has_fmt == false)
+					throw std::runtime_error("WavFile: data chunk before fmt chunk");
+				samples = body;
+				num_frames = body_size/(num_channels*bytes_per_sample);
+				return;
+			}
+			//Chunks are padded to even sizes
+			pos += 8 + chunk_size + (chunk_size&1);
+		}
+		throw std::runtime_error("WavFile: no data chunk found");
+	}
+
+	template <typename T>
+	static T readLE(const uint8_t* p)
+	{
+		T v = 0;
+		for(size_t i=0;i<sizeof(T);i++)
+			v |= (T)p[i] << (8*i);
+		return v;
+	}
+
+	const uint8_t* mapped = nullptr;
+	size_t file_size = 0;
+	const uint8_t* samples = nullptr;
+	size_t num_frames = 0;
+	size_t num_channels = 0;
+	size_t sample_rate = 0;
+	size_t bytes_per_sample = 2;
+	bool is_float = false;
+};
+
+//Encodes the dB level of every spectrum bin with a ScalarEncoder and concatenates them
+struct SpectrumEncoder
+{
+	SpectrumEncoder() = default;
+	SpectrumEncoder(size_t num_bins, float min_db, float max_db, size_t encode_len, size_t width_per_bin)
+		: encoder(min_db, max_db, encode_len, width_per_bin), num_bins(num_bins)
+	{}
+
+	//Writes into a preallocated SDR of sdrLength() bits
+	void encode(const float* levels, xt::xarray<bool>& res) const
+	{
+		size_t width = encoder.sdrLength();
+		size_t len = encoder.encodeLength();
+		float encode_space = width - len;
+		bool* ptr = res.data();
+		std::fill(ptr, ptr+sdrLength(), false);
+		for(size_t i=0;i<num_bins;i++) {
+			float v = (levels[i] - encoder.miniumValue())/(encoder.maximumValue()-encoder.miniumValue());
+			//NaN compares false and ends up at the bottom of the range, as does -inf (silence)
+			v = v > 0.f ? std::min(v, 1.f) : 0.f;
+			size_t start = i*width + (size_t)(encode_space*v);
+			std::fill(ptr+start, ptr+start+len, true);
+		}
+	}
+
+	xt::xarray<bool> encode(const xt::xarray<float>& levels) const
+	{
+		if(levels.size() != num_bins)
+			throw std::runtime_error("SpectrumEncoder: expecting " + std::to_string(num_bins)
+				+ " bins, but get " + std::to_string(levels.size()));
+		xt::xarray<bool> res = xt::zeros<bool>({sdrLength()});
+		encode(levels.data(), res);
+		return res;
+	}
+
+	size_t sdrLength() const {return num_bins*encoder.sdrLength();}
+	size_t numBins() const {return num_bins;}
+
+	HTM::ScalarEncoder encoder;
+	size_t num_bins = 0;
+};
+
+//Streams a WAV file through EarDFT, SpectrumEncoder and a TemporalMemory.
+//Decoding, DFT/encoding and the TM run on their own threads. Every stage owns
+//two buffers and hands them to the next through a lock-free queue, so each
+//stage works on one hop while the next stage consumes the other.
+class AudioPipeline
+{
+public:
+	//Called once per hop with the hop index, the encoded spectrum and its anomaly score
+	using Callback = std::function<void(size_t, const xt::xarray<bool>&, float)>;
+
+	AudioPipeline(const std::string& path, size_t num_bins = 64, size_t window_size = 1024, size_t hop_size = 512)
+		: wav(path), dft(num_bins, wav.sampleRate(), window_size)
+		, encoder(num_bins, -90, 0, 4, 32), hop(hop_size)
+	{
+		if(hop_size == 0 || hop_size > window_size)
+			throw std::runtime_error("AudioPipeline: hop size must be in (0, window_size]");
+	}
+
+	//Processes the entire file. The callback runs on the calling thread
+	void run(HTM::TemporalMemory& tm, Callback callback, bool learn = true)
+	{
+		if(tm.inputSize() != sdrLength())
+			throw std::runtime_error("AudioPipeline: TemporalMemory expects " + std::to_string(tm.inputSize())
+				+ " bits, but the encoder generates " + std::to_string(sdrLength()));
+
+		HTM::SPSCQueue<PCMBlock> pcm_free(2), pcm_full(2);
+		HTM::SPSCQueue<SDRBlock> sdr_free(2), sdr_full(2);
+		for(int i=0;i<2;i++) {
+			pcm_free.push(PCMBlock{std::vector<float>(hop), 0, false});
+			sdr_free.push(SDRBlock{xt::zeros<bool>({sdrLength()}), 0, false});
+		}
+
+		//Stops and joins the workers however run() is left, so an exception from the
+		//callback or the TM doesn't leave joinable threads behind
+		std::atomic<bool> stop{false};
+		std::vector<std::thread> workers;
+		struct WorkerGuard
+		{
+			~WorkerGuard()
+			{
+				stop = true;
+				for(auto& t : workers) {
+					if(t.joinable())
+						t.join();
+				}
+			}
+			std::atomic<bool>& stop;
+			std::vector<std::thread>& workers;
+		} guard{stop, workers};
+
+		workers.emplace_back([&](){
+			size_t pos = 0;
+			for(size_t index=0;;index++) {
+				PCMBlock block;
+				if(pcm_free.pop(block, stop) == false)
+					return;
+				size_t n = wav.read(pos, hop, block.samples.data());
+				pos += n;
+				//The final partial hop is zero padded and processed like any other
+				std::fill(block.samples.begin()+n, block.samples.end(), 0.f);
+				block.index = index;
+				block.last = n == 0;
+				if(pcm_full.push(block, stop) == false || n == 0)
+					return;
+			}
+		});
+
+		workers.emplace_back([&](){
+			size_t window_size = dft.ftSize;
+			std::vector<float> window(window_size, 0.f);
+			std::vector<float> outgoing(hop);
+			std::vector<float> levels(encoder.numBins());
+			bool sliding = SlidingEarDFT::worthwhile(window_size, hop);
+			SlidingEarDFT sliding_dft;
+			if(sliding)
+				sliding_dft = SlidingEarDFT(dft, hop);
+			while(true) {
+				PCMBlock block;
+				if(pcm_full.pop(block, stop) == false)
+					return;
+				if(block.last) {
+					SDRBlock out;
+					if(sdr_free.pop(out, stop) == false)
+						return;
+					out.last = true;
+					sdr_full.push(out, stop);
+					return;
+				}
+				//Slide the window by one hop
+				std::memcpy(outgoing.data(), window.data(), hop*sizeof(float));
+				std::memmove(window.data(), window.data()+hop, (window_size-hop)*sizeof(float));
+				std::memcpy(window.data()+window_size-hop, block.samples.data(), hop*sizeof(float));
+				size_t index = block.index;
+				if(pcm_free.push(block, stop) == false)
+					return;
+
+				if(sliding)
+					sliding_dft.compute(window.data(), outgoing.data(), levels.data());
+				else
+					dft.compute(window.data(), levels.data());
+				SDRBlock out;
+				if(sdr_free.pop(out, stop) == false)
+					return;
+				encoder.encode(levels.data(), out.sdr);
+				out.index = index;
+				out.last = false;
+				if(sdr_full.push(out, stop) == false)
+					return;
+			}
+		});
+
+		while(true) {
+			SDRBlock block = sdr_full.pop();
+			if(block.last)
+				break;
+			float score = tm.computeWithAnomaly(block.sdr, learn);
+			callback(block.index, block.sdr, score);
+			sdr_free.push(std::move(block));
+		}
+	}
+
+	size_t sdrLength() const {return encoder.sdrLength();}
+	size_t hopSize() const {return hop;}
+	const WavFile& file() const {return wav;}
+
+	SpectrumEncoder& spectrumEncoder() {return encoder;}
+
+protected:
+	struct PCMBlock
+	{
+		std::vector<float> samples;
+		size_t index;
+		bool last;
+	};
+
+	struct SDRBlock
+	{
+		xt::xarray<bool> sdr;
+		size_t index;
+		bool last;
+	};
+
+	WavFile wav;
+	EarDFT dft;
+	SpectrumEncoder encoder;
+	size_t hop;
+};
@@ -20,6 +20,18 @@ float random(float min=0, float max=1)
 	return diff*dist(eng) + min;
 }
 
+//atan2 approximation without branches (so loops over it vectorize). Max error about 1e-5 rad
+inline float fastAtan2(float y, float x)
+{
+	float ax = std::abs(x), ay = std::abs(y);
+	float a = std::min(ax, ay)/(std::max(ax, ay)+1e-30f);
+	float s = a*a;
+	float r = a*(0.9998660f + s*(-0.3302995f + s*(0.1801410f + s*(-0.0851330f + s*0.0208351f))));
+	r = ay > ax ? 1.57079637f - r : r;
+	r = x < 0 ? 3.14159274f - r : r;
+	return y < 0 ? -r : r;
+}
+
 int roundCoord(float x)
 {
 	int v = (int)x + ((x-(int)x) > 0.5 ? 1 : -1);
@@ -28,6 +40,18 @@ int roundCoord(float x)
 	return v;
 }
 
+//x mod period, in [0, period). A tiny negative x rounds to exactly period, which would index the
+//next module, so the result is clamped just below it
+inline float wrapCoord(float x, float period = 4.f)
+{
+	return std::min(x - period*std::floor(x/period), std::nextafter(period, 0.f));
+}
+
+inline glm::vec2 wrapCoord(glm::vec2 v, glm::vec2 period)
+{
+	return glm::vec2(wrapCoord(v.x, period.x), wrapCoord(v.y, period.y));
+}
+
 class GridCellUnit2D
 {
 public:
@@ -47,7 +71,7 @@ public:
 		SDR res = xt::zeros<bool>({border_len[0], border_len[1]});
 		
 		//Wrap the position
-		glm::vec2 grid_cord = glm::mod(transform_matrix*pos/scale+bias, border_len);
+		glm::vec2 grid_cord = wrapCoord(transform_matrix*pos/scale+bias, border_len);
 
 		//Set the nearest cell to active
 		xt::view(res, (int)grid_cord[1], (int)grid_cord[0]) = 1;
@@ -62,11 +86,43 @@ public:
 		return res;
 	}
 
+	//Sets the two active cells in a FixedSDR or PackedSDR, starting at bit offset
+	template <typename SDRType>
+	void encode(glm::vec2 pos, SDRType& out, size_t offset) const
+	{
+		glm::vec2 grid_cord = wrapCoord(transform_matrix*pos/scale+bias, border_len);
+		size_t width = border_len[1];
+		out.set(offset + (int)grid_cord[1]*width + (int)grid_cord[0]);
+		int cx = roundCoord(grid_cord[1])%4;
+		int cy = roundCoord(grid_cord[0])%4;
+		out.set(offset + cx*width + cy);
+	}
+
 	size_t encodeSize() const
 	{
 		return border_len[0] * border_len[1];
 	}
 
+	//Integer form of the module's affine map. Coordinates are expressed in turns of the 4 cell
+	//period scaled by 2^32, so wrapping around the period is plain integer overflow.
+	//u[r] = ((a[r][0]*px + a[r][1]*py) >> 32) + b[r] where px, py is the position in 1/65536 units
+	struct FixedPoint
+	{
+		int64_t a[2][2];
+		uint32_t b[2];
+	};
+
+	FixedPoint fixedPoint() const
+	{
+		FixedPoint res;
+		for(int r=0;r<2;r++) {
+			for(int c=0;c<2;c++)
+				res.a[r][c] = std::llround((double)transform_matrix[c][r]/((double)border_len[r]*scale)*281474976710656.0); //2^48
+			res.b[r] = (uint32_t)std::llround((double)bias[r]/border_len[r]*4294967296.0); //2^32
+		}
+		return res;
+	}
+
 	glm::mat2x2 transform_matrix;
 	glm::vec2 border_len;
 	glm::vec2 bias;
@@ -80,6 +136,7 @@ public:
 	{
 		for(int i=0;i<num_modules_;i++)
 			units.push_back(GridCellUnit2D());
+		updateFixedPoint();
 	}
 
 	SDR encode(glm::vec2 pos) const
@@ -91,23 +148,682 @@ public:
 		size_t start = 0;
 		for(const auto& u : units) {
 			size_t l = u.encodeSize();
-			xt::view(res, xt::range((int)start, l)) = u.encode(pos);
+			xt::view(res, xt::range(start, start+l)) = u.encode(pos);
 			start += l;
 		}
 		return res;
 	}
-	
+
+	//Integer only version of encode(). The same coefficients give the same result on every CPU.
+	//The position is rounded to 1/65536, so it can disagree with encode() right at cell borders
+	SDR encodeFixedPoint(glm::vec2 pos) const
+	{
+		SDR res = xt::zeros<bool>({units.size()*16});
+		forEachFixedPointCell(pos, [&](size_t i){res[i] = true;});
+		return res;
+	}
+
+	//Sets the active cells in a FixedSDR or PackedSDR
+	template <typename SDRType>
+	void encodeFixedPoint(glm::vec2 pos, SDRType& out) const
+	{
+		forEachFixedPointCell(pos, [&](size_t i){out.set(i);});
+	}
+
+	//Rebuilds the integer coefficients. Call after modifying units
+	void updateFixedPoint()
+	{
+		fixed_units.clear();
+		for(const auto& u : units) {
+			if(u.border_len[0] != 4 || u.border_len[1] != 4)
+				throw std::runtime_error("GridCellEncoder2D: fixed point encoding only supports 4x4 modules");
+			fixed_units.push_back(u.fixedPoint());
+		}
+	}
+
 	std::vector<GridCellUnit2D> units;
+
+protected:
+	template <typename F>
+	void forEachFixedPointCell(glm::vec2 pos, F f) const
+	{
+		uint64_t px = std::llround((double)pos.x*65536.0);
+		uint64_t py = std::llround((double)pos.y*65536.0);
+		const auto& lut = neighborLUT();
+		for(size_t i=0;i<fixed_units.size();i++) {
+			const auto& m = fixed_units[i];
+			//Wrapping unsigned arithmetic gives the low bits of the signed product
+			uint32_t ux = (uint32_t)(((uint64_t)m.a[0][0]*px + (uint64_t)m.a[0][1]*py) >> 32) + m.b[0];
+			uint32_t uy = (uint32_t)(((uint64_t)m.a[1][0]*px + (uint64_t)m.a[1][1]*py) >> 32) + m.b[1];
+			uint8_t cells = lut[(uy >> 29) << 3 | (ux >> 29)];
+			f(i*16 + (cells & 0xf));
+			f(i*16 + (cells >> 4));
+		}
+	}
+
+	//Indexed by the cell and the half of the cell the coordinate lies in (3 bits per axis).
+	//The low nibble is the nearest cell and the high nibble the 2nd nearest, as in GridCellUnit2D::encode
+	static const std::array<uint8_t, 64>& neighborLUT()
+	{
+		static const std::array<uint8_t, 64> lut = [](){
+			std::array<uint8_t, 64> res;
+			for(int ky=0;ky<8;ky++) {
+				for(int kx=0;kx<8;kx++) {
+					int y = ky>>1, x = kx>>1;
+					int ny = (y + ((ky&1) ? 1 : 3))%4;
+					int nx = (x + ((kx&1) ? 1 : 3))%4;
+					res[ky<<3 | kx] = (y*4+x) | (ny*4+nx) << 4;
+				}
+			}
+			return res;
+		}();
+		return lut;
+	}
+
+	std::vector<GridCellUnit2D::FixedPoint> fixed_units;
+};
+
+//GridCellEncoder2D with the number of modules known at compile time
+template <size_t NumModules = 32>
+class FixedGridCellEncoder2D : public GridCellEncoder2D
+{
+public:
+	static constexpr size_t sdr_size = NumModules*16;
+	using SDRType = HTM::FixedSDR<sdr_size>;
+
+	FixedGridCellEncoder2D()
+		: GridCellEncoder2D(NumModules)
+	{}
+
+	SDRType encodeFixed(glm::vec2 pos) const
+	{
+		SDRType res;
+		for(size_t i=0;i<NumModules;i++)
+			units[i].encode(pos, res, i*16);
+		return res;
+	}
+};
+
+//Grid cell encoder for D dimensional inputs. Every module projects the input onto its own plane with
+//a random projection (orthonormal rows divided by the module scale) and then encodes the position on
+//the plane like GridCellUnit2D. The projections of all modules are stored as one contiguous
+//(2*num_modules x D) matrix, so encoding is a single matrix-vector product plus the lattice lookup.
+template <size_t D>
+class GridCellEncoderND
+{
+	static_assert(D > 0, "GridCellEncoderND: needs at least one dimension");
+public:
+	using Position = std::array<float, D>;
+
+	GridCellEncoderND(size_t num_modules = 32)
+		: num_modules(num_modules), projection(num_modules*2*D), bias(num_modules*2)
+	{
+		for(size_t m=0;m<num_modules;m++) {
+			float scale = random(6, 25);
+			std::array<float, D> u, v;
+			if(D == 1) {
+				float theta = random(0, 6.28);
+				u[0] = cos(theta);
+				v[0] = sin(theta);
+			}
+			else {
+				//Two random orthonormal directions by Gram-Schmidt on gaussian vectors
+				for(size_t d=0;d<D;d++) {
+					u[d] = gaussian();
+					v[d] = gaussian();
+				}
+				normalize(u);
+				float dot = 0;
+				for(size_t d=0;d<D;d++)
+					dot += u[d]*v[d];
+				for(size_t d=0;d<D;d++)
+					v[d] -= dot*u[d];
+				normalize(v);
+			}
+			for(size_t d=0;d<D;d++) {
+				projection[(2*m)*D+d] = u[d]/scale;
+				projection[(2*m+1)*D+d] = v[d]/scale;
+			}
+			bias[2*m] = random(0, 4);
+			bias[2*m+1] = random(0, 4);
+		}
+	}
+
+	//Takes over the modules of a 2D encoder. Results match GridCellEncoder2D::encode() except for
+	//rounding differences right at cell borders, as the scale is folded into the projection
+	template <size_t Dim = D, typename = std::enable_if_t<Dim == 2>>
+	explicit GridCellEncoderND(const GridCellEncoder2D& encoder)
+		: num_modules(encoder.units.size()), projection(num_modules*2*D), bias(num_modules*2)
+	{
+		for(size_t m=0;m<num_modules;m++) {
+			const auto& u = encoder.units[m];
+			if(u.border_len[0] != 4 || u.border_len[1] != 4)
+				throw std::runtime_error("GridCellEncoderND: only 4x4 modules are supported");
+			for(size_t r=0;r<2;r++) {
+				for(size_t c=0;c<2;c++)
+					projection[(2*m+r)*D+c] = u.transform_matrix[c][r]/u.scale;
+				bias[2*m+r] = u.bias[r];
+			}
+		}
+	}
+
+	SDR encode(const Position& pos) const
+	{
+		SDR res = xt::zeros<bool>({sdrLength()});
+		bool* ptr = res.data();
+		forEachCell(pos, [ptr](size_t i){ptr[i] = true;});
+		return res;
+	}
+
+	//Sets the active cells in a FixedSDR or PackedSDR
+	template <typename SDRType>
+	void encode(const Position& pos, SDRType& out) const
+	{
+		forEachCell(pos, [&out](size_t i){out.set(i);});
+	}
+
+	template <size_t Dim = D, typename = std::enable_if_t<Dim == 2>>
+	SDR encode(glm::vec2 pos) const
+	{
+		return encode(Position{pos.x, pos.y});
+	}
+
+	//Encodes many positions into a (positions.size(), sdrLength()) array. The projection of the
+	//whole batch is computed first as one matrix product
+	xt::xarray<bool> encodeBatch(const std::vector<Position>& positions) const
+	{
+		size_t rows = 2*num_modules;
+		std::vector<float> projected(positions.size()*rows);
+		for(size_t i=0;i<positions.size();i++) {
+			float* out = projected.data()+i*rows;
+			for(size_t r=0;r<rows;r++)
+				out[r] = project(r, positions[i]);
+		}
+
+		xt::xarray<bool> res = xt::zeros<bool>({positions.size(), sdrLength()});
+		bool* ptr = res.data();
+		for(size_t i=0;i<positions.size();i++) {
+			const float* g = projected.data()+i*rows;
+			bool* sdr = ptr+i*sdrLength();
+			for(size_t m=0;m<num_modules;m++)
+				latticeCells(g[2*m], g[2*m+1], m, [sdr](size_t j){sdr[j] = true;});
+		}
+		return res;
+	}
+
+	size_t numModules() const {return num_modules;}
+	size_t sdrLength() const {return num_modules*16;}
+
+protected:
+	float project(size_t row, const Position& pos) const
+	{
+		const float* p = projection.data()+row*D;
+		float s = bias[row];
+		for(size_t d=0;d<D;d++)
+			s += p[d]*pos[d];
+		return s;
+	}
+
+	template <typename F>
+	void forEachCell(const Position& pos, F f) const
+	{
+		for(size_t m=0;m<num_modules;m++)
+			latticeCells(project(2*m, pos), project(2*m+1, pos), m, f);
+	}
+
+	//Same cell selection as GridCellUnit2D::encode()
+	template <typename F>
+	static void latticeCells(float x, float y, size_t module, F f)
+	{
+		x = wrapCoord(x);
+		y = wrapCoord(y);
+		f(module*16 + (int)y*4 + (int)x);
+		f(module*16 + (roundCoord(y)%4)*4 + roundCoord(x)%4);
+	}
+
+	static float gaussian()
+	{
+		float u1 = 1.f-random(0, 1);
+		float u2 = random(0, 1);
+		return std::sqrt(-2.f*std::log(u1))*std::cos(6.2831853f*u2);
+	}
+
+	static void normalize(std::array<float, D>& v)
+	{
+		float len = 0;
+		for(auto x : v)
+			len += x*x;
+		len = std::sqrt(len);
+		for(auto& x : v)
+			x /= len;
+	}
+
+	size_t num_modules;
+	//Row 2m and 2m+1 are the plane axes of module m, already divided by its scale
+	std::vector<float> projection;
+	std::vector<float> bias;
 };
 
 class LocEncoder2D
 {
 public:
+	//Bits and on bits per axis. The encoders are fixed to them, as sdr_size and SDRType depend on them
+	static constexpr size_t axis_size = 16*16;
+	static constexpr size_t encode_length = 26;
+	static constexpr size_t sdr_size = 2*axis_size;
+	using SDRType = HTM::FixedSDR<sdr_size>;
+
+	LocEncoder2D()
+		: x_encoder(0, 800, encode_length, axis_size), y_encoder(0, 600, encode_length, axis_size)
+	{}
+
 	SDR encode(glm::vec2 pos) const
 	{
-		SDR res = xt::concatenate(xt::xtuple(HTM::encodeScalar(pos.x, 0, 800, 26, 16*16), HTM::encodeScalar(pos.y, 0, 600, 26, 16*16)));
-		res.reshape({res.size()});
+		SDR res = xt::zeros<bool>({sdr_size});
+		encode(pos, res);
+		return res;
+	}
+
+	//Writes into a preallocated SDR. It is only resized if it has the wrong size
+	void encode(glm::vec2 pos, SDR& res) const
+	{
+		if(res.size() != sdr_size)
+			res.resize({sdr_size});
+		x_encoder.encode(pos.x, res.data());
+		y_encoder.encode(pos.y, res.data()+axis_size);
+	}
+
+	//Encodes many positions into a (positions.size(), sdr_size) array
+	SDR encodeBatch(const std::vector<glm::vec2>& positions) const
+	{
+		SDR res = xt::zeros<bool>({positions.size(), sdr_size});
+		bool* ptr = res.data();
+		for(const auto& pos : positions) {
+			size_t x = x_encoder.encodeStart(pos.x);
+			size_t y = axis_size + y_encoder.encodeStart(pos.y);
+			std::fill(ptr+x, ptr+x+encode_length, true);
+			std::fill(ptr+y, ptr+y+encode_length, true);
+			ptr += sdr_size;
+		}
+		return res;
+	}
+
+	SDRType encodeFixed(glm::vec2 pos) const
+	{
+		SDRType res;
+		size_t x = x_encoder.encodeStart(pos.x);
+		size_t y = axis_size + y_encoder.encodeStart(pos.y);
+		for(size_t i=0;i<encode_length;i++) {
+			res.set(x+i);
+			res.set(y+i);
+		}
+		return res;
+	}
+
+	std::vector<UInt> encodeSparse(glm::vec2 pos) const
+	{
+		std::vector<UInt> res(2*encode_length);
+		size_t x = x_encoder.encodeStart(pos.x);
+		size_t y = axis_size + y_encoder.encodeStart(pos.y);
+		std::iota(res.begin(), res.begin()+encode_length, x);
+		std::iota(res.begin()+encode_length, res.end(), y);
+		return res;
+	}
+
+	const HTM::ScalarEncoder& xEncoder() const {return x_encoder;}
+	const HTM::ScalarEncoder& yEncoder() const {return y_encoder;}
+
+private:
+	const HTM::ScalarEncoder x_encoder;
+	const HTM::ScalarEncoder y_encoder;
+};
+
+//Drop-in replacement for LocEncoder2D using a RandomDistributedScalarEncoder per axis. The bucket
+//sizes match LocEncoder2D over the window, but positions outside of it are still distinguished
+class RDSELocEncoder2D
+{
+public:
+	static constexpr size_t sdr_size = 2*16*16;
+	using SDRType = HTM::FixedSDR<sdr_size>;
+
+	RDSELocEncoder2D()
+		: x_encoder(800.f/(16*16-26), 26, 16*16, 1)
+		, y_encoder(600.f/(16*16-26), 26, 16*16, 2)
+	{}
+
+	SDR encode(glm::vec2 pos) const
+	{
+		SDR res = xt::zeros<bool>({sdr_size});
+		for(auto i : encodeSparse(pos))
+			res[i] = true;
+		return res;
+	}
+
+	SDRType encodeFixed(glm::vec2 pos) const
+	{
+		SDRType res;
+		x_encoder.encode(pos.x, res, 0);
+		y_encoder.encode(pos.y, res, 16*16);
+		return res;
+	}
+
+	std::vector<UInt> encodeSparse(glm::vec2 pos) const
+	{
+		std::vector<UInt> res, y;
+		x_encoder.encodeSparse(pos.x, res, 0);
+		y_encoder.encodeSparse(pos.y, y, 16*16);
+		res.insert(res.end(), y.begin(), y.end());
+		return res;
+	}
+
+	HTM::RandomDistributedScalarEncoder x_encoder;
+	HTM::RandomDistributedScalarEncoder y_encoder;
+};
+
+//Encodes where an object is and how it moves. The SDR is the grid cell encoding of the position
+//followed by the speed and the heading of the finite difference to the previous sample of the same
+//object. The previous position of every object is kept in flat arrays, so encoding is incremental.
+//The position uses the fixed point grid cell path, so single and batch encodes are identical.
+class TrajectoryEncoder
+{
+public:
+	TrajectoryEncoder(size_t num_objects = 1, float max_speed = 20, int num_modules = 32)
+		: position_encoder(num_modules), speed_encoder(0, max_speed, 8, 64)
+	{
+		resize(num_objects);
+	}
+
+	//Encodes the next position of an object and remembers it
+	SDR encode(glm::vec2 pos, size_t object = 0)
+	{
+		if(object >= numObjects())
+			resize(object+1);
+		SDR res = xt::zeros<bool>({sdrLength()});
+		float dx = has_prev[object] ? pos.x-prev_x[object] : 0;
+		float dy = has_prev[object] ? pos.y-prev_y[object] : 0;
+		float speed = std::sqrt(dx*dx+dy*dy);
+		if(speed >= min_speed)
+			last_heading[object] = fastAtan2(dy, dx);
+		encodeInto(pos, speed, last_heading[object], res.data());
+		prev_x[object] = pos.x;
+		prev_y[object] = pos.y;
+		has_prev[object] = 1;
+		return res;
+	}
+
+	//Encodes the next position of objects 0 to positions.size()-1 into a (positions.size(), sdrLength())
+	//array. Velocities and headings of all objects are computed in one vectorizable pass
+	SDR encodeBatch(const std::vector<glm::vec2>& positions)
+	{
+		size_t n = positions.size();
+		if(n > numObjects())
+			resize(n);
+		xs.resize(n);
+		ys.resize(n);
+		speeds.resize(n);
+		for(size_t i=0;i<n;i++) {
+			xs[i] = positions[i].x;
+			ys[i] = positions[i].y;
+		}
+
+		const float* x = xs.data();
+		const float* y = ys.data();
+		float* px = prev_x.data();
+		float* py = prev_y.data();
+		float* heading = last_heading.data();
+		float* speed = speeds.data();
+		const uint8_t* valid = has_prev.data();
+		for(size_t i=0;i<n;i++) {
+			float dx = valid[i] ? x[i]-px[i] : 0.f;
+			float dy = valid[i] ? y[i]-py[i] : 0.f;
+			speed[i] = std::sqrt(dx*dx+dy*dy);
+			heading[i] = speed[i] >= min_speed ? fastAtan2(dy, dx) : heading[i];
+			px[i] = x[i];
+			py[i] = y[i];
+		}
+		std::fill(has_prev.begin(), has_prev.begin()+n, 1);
+
+		SDR res = xt::zeros<bool>({n, sdrLength()});
+		for(size_t i=0;i<n;i++)
+			encodeInto(positions[i], speed[i], heading[i], res.data()+i*sdrLength());
+		return res;
+	}
+
+	//Forgets the previous position of an object, i.e. when a new track starts
+	void reset(size_t object)
+	{
+		if(object < numObjects()) {
+			has_prev[object] = 0;
+			last_heading[object] = 0;
+		}
+	}
+
+	void reset()
+	{
+		std::fill(has_prev.begin(), has_prev.end(), 0);
+		std::fill(last_heading.begin(), last_heading.end(), 0);
+	}
+
+	void resize(size_t num_objects)
+	{
+		prev_x.resize(num_objects, 0);
+		prev_y.resize(num_objects, 0);
+		last_heading.resize(num_objects, 0);
+		has_prev.resize(num_objects, 0);
+	}
+
+	size_t numObjects() const {return has_prev.size();}
+	size_t sdrLength() const {return positionLength() + speed_encoder.sdrLength() + heading_bits;}
+
+	GridCellEncoder2D position_encoder;
+	HTM::ScalarEncoder speed_encoder;
+	size_t heading_bits = 64;
+	size_t heading_active = 8;
+	//Below this speed the heading is not updated
+	float min_speed = 1e-3;
+
+protected:
+	size_t positionLength() const {return position_encoder.units.size()*16;}
+
+	void encodeInto(glm::vec2 pos, float speed, float heading, bool* out) const
+	{
+		struct DenseSetter
+		{
+			bool* ptr;
+			void set(size_t i) {ptr[i] = true;}
+		} setter{out};
+		position_encoder.encodeFixedPoint(pos, setter);
+
+		bool* speed_bits = out+positionLength();
+		speed_encoder.encode(speed, speed_bits);
+
+		//Heading is cyclic, so its run wraps around
+		bool* heading_bits_ptr = speed_bits+speed_encoder.sdrLength();
+		float turn = heading/6.2831853f;
+		turn -= std::floor(turn);
+		size_t start = (size_t)(turn*heading_bits) % heading_bits;
+		for(size_t i=0;i<heading_active;i++)
+			heading_bits_ptr[(start+i)%heading_bits] = true;
+	}
+
+	std::vector<float> prev_x;
+	std::vector<float> prev_y;
+	std::vector<float> last_heading;
+	std::vector<uint8_t> has_prev;
+	//Scratch buffers of encodeBatch()
+	std::vector<float> xs, ys, speeds;
+};
+
+//Memoizes any position encoder. Positions are quantized to a grid of the given resolution and
+//the encoding of the grid point is cached as a sparse SDR in a bounded hash table. Lookups never
+//lock: each slot is guarded by a sequence counter, and a reader that races with a writer simply
+//counts as a miss. Inserts are serialized by a mutex. When all probed slots are taken, one of them
+//is evicted.
+template <typename Encoder>
+class CachedEncoder
+{
+public:
+	CachedEncoder(Encoder enc = Encoder(), float resolution = 1.f, size_t capacity = 4096, size_t max_active_bits = 128)
+		: base_encoder(std::move(enc)), quantize_resolution(resolution), max_active(max_active_bits)
+	{
+		if(resolution <= 0)
+			throw std::runtime_error("CachedEncoder: resolution must be > 0");
+		size_t cap = 1;
+		while(cap < std::max<size_t>(capacity, probe_length))
+			cap *= 2;
+		mask = cap-1;
+		slots.reset(new Slot[cap]);
+		indices.reset(new std::atomic<uint32_t>[cap*max_active]);
+		sdr_length = base_encoder.encode(glm::vec2(0, 0)).size();
+	}
+
+	SDR encode(glm::vec2 pos) const
+	{
+		SDR res = xt::zeros<bool>({sdr_length});
+		for(auto i : encodeSparse(pos))
+			res[i] = true;
+		return res;
+	}
 
+	//Indices of the on bits in increasing order. Throws for non-finite positions and for positions
+	//whose grid point does not fit an int64_t
+	std::vector<UInt> encodeSparse(glm::vec2 pos) const
+	{
+		Key key = quantize(pos);
+		size_t base = hash(key);
+
+		std::vector<UInt> res;
+		for(size_t p=0;p<probe_length;p++) {
+			size_t s = (base+p)&mask;
+			if(read(s, key, res) == true) {
+				num_hits.fetch_add(1, std::memory_order_relaxed);
+				return res;
+			}
+		}
+
+		num_misses.fetch_add(1, std::memory_order_relaxed);
+		res = HTM::sparsify(base_encoder.encode(glm::vec2((float)key.x, (float)key.y)*quantize_resolution));
+		if(res.size() <= max_active)
+			write(base, key, res);
 		return res;
 	}
-};
\ No newline at end of file
+
+	size_t hits() const {return num_hits.load(std::memory_order_relaxed);}
+	size_t misses() const {return num_misses.load(std::memory_order_relaxed);}
+	float hitRate() const {return hits()+misses() == 0 ? 0.f : (float)hits()/(hits()+misses());}
+
+	void resetStats()
+	{
+		num_hits = 0;
+		num_misses = 0;
+	}
+
+	//Drops every cached encoding. Must not run concurrently with encode()
+	void clear()
+	{
+		for(size_t i=0;i<=mask;i++)
+			slots[i].seq = 0;
+	}
+
+	const Encoder& baseEncoder() const {return base_encoder;}
+	float resolution() const {return quantize_resolution;}
+	size_t capacity() const {return mask+1;}
+
+protected:
+	static constexpr size_t probe_length = 4;
+
+	//Grid point of a position
+	struct Key
+	{
+		int64_t x, y;
+	};
+
+	struct Slot
+	{
+		//0: never written. Odd: being written
+		std::atomic<uint32_t> seq{0};
+		std::atomic<int64_t> key_x{0};
+		std::atomic<int64_t> key_y{0};
+		std::atomic<uint32_t> count{0};
+
+		bool holds(const Key& key) const
+		{
+			return key_x.load(std::memory_order_relaxed) == key.x && key_y.load(std::memory_order_relaxed) == key.y;
+		}
+	};
+
+	Key quantize(glm::vec2 pos) const
+	{
+		//2^63, exact as a float
+		const float limit = 9223372036854775808.f;
+		float x = std::floor(pos.x/quantize_resolution);
+		float y = std::floor(pos.y/quantize_resolution);
+		if(std::isfinite(x) == false || std::isfinite(y) == false)
+			throw std::runtime_error("CachedEncoder: position must be finite");
+		if(x < -limit || x >= limit || y < -limit || y >= limit)
+			throw std::runtime_error("CachedEncoder: position is out of range for the resolution");
+		return {(int64_t)x, (int64_t)y};
+	}
+
+	size_t hash(const Key& key) const
+	{
+		uint64_t h = (uint64_t)key.x*0x9e3779b97f4a7c15ULL ^ (uint64_t)key.y;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		return h & mask;
+	}
+
+	bool read(size_t s, const Key& key, std::vector<UInt>& res) const
+	{
+		const Slot& slot = slots[s];
+		uint32_t seq = slot.seq.load(std::memory_order_acquire);
+		if(seq == 0 || (seq&1) == 1 || slot.holds(key) == false)
+			return false;
+		uint32_t n = slot.count.load(std::memory_order_relaxed);
+		res.resize(n);
+		const std::atomic<uint32_t>* idx = indices.get()+s*max_active;
+		for(size_t i=0;i<n;i++)
+			res[i] = idx[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot.seq.load(std::memory_order_relaxed) == seq;
+	}
+
+	void write(size_t base, const Key& key, const std::vector<UInt>& value) const
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		size_t s = (base+victim++%probe_length)&mask;
+		for(size_t p=0;p<probe_length;p++) {
+			size_t candidate = (base+p)&mask;
+			const Slot& slot = slots[candidate];
+			if(slot.seq.load(std::memory_order_relaxed) == 0 || slot.holds(key)) {
+				s = candidate;
+				break;
+			}
+		}
+
+		Slot& slot = slots[s];
+		uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+		slot.seq.store(seq+1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.key_x.store(key.x, std::memory_order_relaxed);
+		slot.key_y.store(key.y, std::memory_order_relaxed);
+		slot.count.store(value.size(), std::memory_order_relaxed);
+		std::atomic<uint32_t>* idx = indices.get()+s*max_active;
+		for(size_t i=0;i<value.size();i++)
+			idx[i].store(value[i], std::memory_order_relaxed);
+		slot.seq.store(seq+2, std::memory_order_release);
+	}
+
+	Encoder base_encoder;
+	float quantize_resolution;
+	size_t max_active;
+	size_t sdr_length;
+	size_t mask;
+	std::unique_ptr<Slot[]> slots;
+	std::unique_ptr<std::atomic<uint32_t>[]> indices;
+	mutable std::mutex write_mutex;
+	mutable size_t victim = 0;
+	mutable std::atomic<size_t> num_hits{0};
+	mutable std::atomic<size_t> num_misses{0};
+};
@@ -10,6 +10,31 @@
 #include <exception>
 #include <algorithm>
 #include <memory>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <string>
+#include <future>
+#include <unordered_map>
+#include <optional>
+#include <random>
+#include <limits>
+#include <numeric>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <cmath>
+#include <array>
+#include <chrono>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 // #define HTM_USE_SYS_XTENSOR will allow users to use a custom vertsion of xtensor instead of the system provided version
 #ifndef HTM_USE_SYS_XTENSOR
@@ -17,6 +42,8 @@
 #include <xtensor/xview.hpp>
 #endif
 
+#include "Parallel.hpp"
+
 namespace HTM
 {
 
@@ -39,6 +66,197 @@ inline std::vector<UInt> sparsify(const xt::xarray<bool>& t)
 	return v;
 }
 
+inline size_t popcount(uint64_t v)
+{
+	return __builtin_popcountll(v);
+}
+
+//Number of common on bits of two packed SDRs of num_words words
+inline size_t overlap(const uint64_t* a, const uint64_t* b, size_t num_words)
+{
+	size_t s = 0;
+	for(size_t i=0;i<num_words;i++)
+		s += popcount(a[i]&b[i]);
+	return s;
+}
+
+//A dense SDR stored as 64 bit words. Bit i lives in bit i%64 of word i/64.
+//Bits after size() in the last word are always 0
+struct PackedSDR
+{
+	PackedSDR() = default;
+	PackedSDR(size_t num_bits)
+		: words(numWords(num_bits)), num_bits(num_bits)
+	{}
+
+	PackedSDR(const xt::xarray<bool>& t)
+	{
+		pack(t);
+	}
+
+	static size_t numWords(size_t num_bits)
+	{
+		return (num_bits+63)/64;
+	}
+
+	void pack(const xt::xarray<bool>& t)
+	{
+		num_bits = t.size();
+		words.resize(numWords(num_bits));
+		const bool* ptr = t.data();
+		for(size_t i=0;i<words.size();i++) {
+			size_t n = std::min<size_t>(64, num_bits-i*64);
+			uint64_t w = 0;
+			for(size_t j=0;j<n;j++)
+				w |= (uint64_t)ptr[i*64+j] << j;
+			words[i] = w;
+		}
+	}
+
+	xt::xarray<bool> unpack() const
+	{
+		xt::xarray<bool> res = xt::zeros<bool>({num_bits});
+		for(size_t i=0;i<num_bits;i++)
+			res[i] = test(i);
+		return res;
+	}
+
+	bool test(size_t i) const {return (words[i/64] >> (i%64)) & 1;}
+	void set(size_t i) {words[i/64] |= (uint64_t)1 << (i%64);}
+	void reset(size_t i) {words[i/64] &= ~((uint64_t)1 << (i%64));}
+	void clear() {std::fill(words.begin(), words.end(), 0);}
+
+	size_t count() const
+	{
+		size_t s = 0;
+		for(auto w : words)
+			s += popcount(w);
+		return s;
+	}
+
+	//Number of on bits in [begin, end)
+	size_t count(size_t begin, size_t end) const
+	{
+		if(begin >= end)
+			return 0;
+		size_t first = begin/64;
+		size_t last = (end-1)/64;
+		uint64_t first_mask = ~(uint64_t)0 << (begin%64);
+		uint64_t last_mask = ~(uint64_t)0 >> (63-(end-1)%64);
+		if(first == last)
+			return popcount(words[first] & first_mask & last_mask);
+		size_t s = popcount(words[first] & first_mask) + popcount(words[last] & last_mask);
+		for(size_t i=first+1;i<last;i++)
+			s += popcount(words[i]);
+		return s;
+	}
+
+	size_t overlap(const PackedSDR& other) const
+	{
+		assert(other.num_bits == num_bits);
+		return HTM::overlap(words.data(), other.words.data(), words.size());
+	}
+
+	size_t size() const {return num_bits;}
+	size_t numWords() const {return words.size();}
+	uint64_t* data() {return words.data();}
+	const uint64_t* data() const {return words.data();}
+
+	std::vector<uint64_t> words;
+	size_t num_bits = 0;
+};
+
+//An SDR of N bits known at compile time. Stored as packed words on the stack, so SDRs of
+//different lengths are different types and size checks happen at compile time
+template <size_t N>
+struct FixedSDR
+{
+	static constexpr size_t num_words = (N+63)/64;
+
+	static constexpr size_t size() {return N;}
+
+	bool test(size_t i) const {return (words[i/64] >> (i%64)) & 1;}
+	void set(size_t i) {words[i/64] |= (uint64_t)1 << (i%64);}
+	void reset(size_t i) {words[i/64] &= ~((uint64_t)1 << (i%64));}
+	void clear() {words.fill(0);}
+
+	size_t count() const
+	{
+		size_t s = 0;
+		for(auto w : words)
+			s += popcount(w);
+		return s;
+	}
+
+	size_t overlap(const FixedSDR& other) const
+	{
+		return HTM::overlap(words.data(), other.words.data(), num_words);
+	}
+
+	//Calls f(index) for every on bit in increasing order
+	template <typename F>
+	void forEach(F f) const
+	{
+		for(size_t i=0;i<num_words;i++) {
+			uint64_t w = words[i];
+			while(w != 0) {
+				f(i*64 + __builtin_ctzll(w));
+				w &= w-1;
+			}
+		}
+	}
+
+	FixedSDR operator& (const FixedSDR& other) const
+	{
+		FixedSDR res;
+		for(size_t i=0;i<num_words;i++)
+			res.words[i] = words[i] & other.words[i];
+		return res;
+	}
+
+	FixedSDR operator| (const FixedSDR& other) const
+	{
+		FixedSDR res;
+		for(size_t i=0;i<num_words;i++)
+			res.words[i] = words[i] | other.words[i];
+		return res;
+	}
+
+	bool operator== (const FixedSDR& other) const {return words == other.words;}
+	bool operator!= (const FixedSDR& other) const {return words != other.words;}
+
+	xt::xarray<bool> toDense() const
+	{
+		xt::xarray<bool> res = xt::zeros<bool>({N});
+		forEach([&](size_t i){res[i] = true;});
+		return res;
+	}
+
+	static FixedSDR fromDense(const xt::xarray<bool>& t)
+	{
+		if(t.size() != N)
+			throw std::runtime_error("FixedSDR: expecting " + std::to_string(N) + " bits, but get " + std::to_string(t.size()));
+		FixedSDR res;
+		for(size_t i=0;i<N;i++) {
+			if(t[i] == true)
+				res.set(i);
+		}
+		return res;
+	}
+
+	std::array<uint64_t, num_words> words{};
+};
+
+//Anomaly score of two FixedSDRs. Same as anomaly() but on packed bits
+template <size_t N>
+inline float anomaly(const FixedSDR<N>& real_value, const FixedSDR<N>& prediction)
+{
+	size_t not_pred_bits = 0;
+	for(size_t i=0;i<FixedSDR<N>::num_words;i++)
+		not_pred_bits += popcount(real_value.words[i] & ~prediction.words[i]);
+	return (float)not_pred_bits/real_value.count();
+}
+
 inline xt::xarray<float> softmax(const xt::xarray<float>& x)
 {
 	auto z = x - xt::amax(x)[0];
@@ -46,6 +264,100 @@ inline xt::xarray<float> softmax(const xt::xarray<float>& x)
 	return e/xt::sum(e);
 }
 
+//exp() approximation. 2^round(x*log2(e)) is built in the exponent bits and the remaining
+//fraction is evaluated by a polynomial. Relative error is a few 1e-6. Inputs are clamped to
+//[-87, 88] so the result never becomes inf or denormal.
+inline float fastExp(float x)
+{
+	x = std::min(std::max(x, -87.f), 88.f);
+	float y = x*1.44269504f;
+	float n = std::floor(y+0.5f);
+	float f = y-n;
+	float p = 1.5403530e-4f;
+	p = p*f + 1.3333558e-3f;
+	p = p*f + 9.6181291e-3f;
+	p = p*f + 5.5504109e-2f;
+	p = p*f + 2.4022651e-1f;
+	p = p*f + 6.9314718e-1f;
+	p = p*f + 1.f;
+	int32_t e = ((int32_t)n+127) << 23;
+	float scale;
+	std::memcpy(&scale, &e, sizeof(scale));
+	return p*scale;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+inline __m256 fastExp(__m256 x)
+{
+	x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.f)), _mm256_set1_ps(88.f));
+	__m256 y = _mm256_mul_ps(x, _mm256_set1_ps(1.44269504f));
+	__m256 n = _mm256_round_ps(y, _MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC);
+	__m256 f = _mm256_sub_ps(y, n);
+	__m256 p = _mm256_set1_ps(1.5403530e-4f);
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.3333558e-3f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(9.6181291e-3f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(5.5504109e-2f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(2.4022651e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(6.9314718e-1f));
+	p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(1.f));
+	__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+	return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+#endif
+
+//Allocation free softmax of n values. out may be the same buffer as x
+inline void softmax(const float* x, float* out, size_t n)
+{
+	if(n == 0)
+		return;
+	size_t i = 0;
+	float max_val = x[0];
+	float sum = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+	if(n >= 8) {
+		__m256 vmax = _mm256_loadu_ps(x);
+		for(i=8;i+8<=n;i+=8)
+			vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x+i));
+		float lanes[8];
+		_mm256_storeu_ps(lanes, vmax);
+		max_val = *std::max_element(lanes, lanes+8);
+	}
+	for(;i<n;i++)
+		max_val = std::max(max_val, x[i]);
+
+	__m256 vm = _mm256_set1_ps(max_val);
+	__m256 vsum = _mm256_setzero_ps();
+	for(i=0;i+8<=n;i+=8) {
+		__m256 e = fastExp(_mm256_sub_ps(_mm256_loadu_ps(x+i), vm));
+		_mm256_storeu_ps(out+i, e);
+		vsum = _mm256_add_ps(vsum, e);
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, vsum);
+	sum = std::accumulate(lanes, lanes+8, 0.f);
+#else
+	for(i=1;i<n;i++)
+		max_val = std::max(max_val, x[i]);
+	i = 0;
+#endif
+	for(;i<n;i++) {
+		out[i] = fastExp(x[i]-max_val);
+		sum += out[i];
+	}
+
+	float inv = 1.f/sum;
+	for(i=0;i<n;i++)
+		out[i] *= inv;
+}
+
+//Output buffer version of softmax. out is only resized if its size does not match x
+inline void softmax(const xt::xarray<float>& x, xt::xarray<float>& out)
+{
+	if(out.size() != x.size())
+		out.resize({x.size()});
+	softmax(x.data(), out.data(), x.size());
+}
+
 //Calcluate the ratio of 1 per category
 inline xt::xarray<float> categroize(int num_category, int len_per_category,const xt::xarray<bool>& in, bool normalize = true)
 {
@@ -58,6 +370,30 @@ inline xt::xarray<float> categroize(int num_category, int len_per_category,const
 	return res;
 }
 
+//Allocation free categroize. Writes num_category values into out
+inline void categroize(int num_category, int len_per_category, const xt::xarray<bool>& in, float* out, bool normalize = true)
+{
+	assert((size_t)num_category*len_per_category == in.size());
+	const bool* ptr = in.data();
+	float scale = normalize ? 1.f/len_per_category : 1.f;
+	for(int i=0;i<num_category;i++) {
+		int s = 0;
+		for(int j=0;j<len_per_category;j++)
+			s += ptr[j];
+		out[i] = s*scale;
+		ptr += len_per_category;
+	}
+}
+
+//Same as above but counts each category's block of a packed SDR with popcount
+inline void categroize(int num_category, int len_per_category, const PackedSDR& in, float* out, bool normalize = true)
+{
+	assert((size_t)num_category*len_per_category == in.size());
+	float scale = normalize ? 1.f/len_per_category : 1.f;
+	for(int i=0;i<num_category;i++)
+		out[i] = in.count((size_t)i*len_per_category, (size_t)(i+1)*len_per_category)*scale;
+}
+
 //Calculate anomaly score given the SDR
 //Implementation in NuPIC deals with sparse array. This deals with dense ones
 inline float anomaly(xt::xarray<bool> real_value, xt::xarray<bool> prediction)
@@ -66,6 +402,77 @@ inline float anomaly(xt::xarray<bool> real_value, xt::xarray<bool> prediction)
 	return (float)xt::sum(not_pred_bits)[0]/xt::sum(real_value)[0];
 }
 
+//Raw anomaly score from sparse state. The fraction of the (sorted) active columns that have no cell
+//in the (sorted) predictive cells. 0 when there is no active column, as in NuPIC
+inline float anomaly(const std::vector<UInt>& active_columns, const std::vector<UInt>& predictive_cells, size_t cells_per_column)
+{
+	if(active_columns.empty())
+		return 0;
+	size_t predicted = 0;
+	auto p = predictive_cells.begin();
+	for(auto col : active_columns) {
+		size_t first_cell = col*cells_per_column;
+		while(p != predictive_cells.end() && *p < first_cell)
+			p++;
+		predicted += p != predictive_cells.end() && *p < first_cell+cells_per_column;
+	}
+	return 1.f - (float)predicted/active_columns.size();
+}
+
+//Maps sorted cells to the sorted columns holding them, without duplicates, into a std::vector<UInt>
+//or the bits of a PackedSDR. out is cleared first. The cells of a column are skipped by comparing
+//against the column's end, so the division happens once per column. Passing cells_per_column as a
+//std::integral_constant makes it a compile-time constant, which turns the division into a shift or
+//a multiply
+template <typename CellsPerColumn, typename Out>
+inline void cellsToColumnsImpl(const std::vector<UInt>& cells, CellsPerColumn cells_per_column, Out& out)
+{
+	out.clear();
+	size_t column_end = 0;
+	for(auto c : cells) {
+		if(c < column_end)
+			continue;
+		UInt col = c/cells_per_column;
+		if constexpr(std::is_same<Out, PackedSDR>::value) {
+			assert(col < out.size());
+			out.set(col);
+		}
+		else
+			out.push_back(col);
+		column_end = (size_t)(col+1)*cells_per_column;
+	}
+}
+
+template <size_t CellsPerColumn>
+inline void cellsToColumns(const std::vector<UInt>& cells, std::vector<UInt>& columns)
+{
+	static_assert(CellsPerColumn != 0, "cellsToColumns: a column must have at least one cell");
+	cellsToColumnsImpl(cells, std::integral_constant<size_t, CellsPerColumn>(), columns);
+}
+
+template <size_t CellsPerColumn>
+inline void cellsToColumns(const std::vector<UInt>& cells, PackedSDR& out)
+{
+	static_assert(CellsPerColumn != 0, "cellsToColumns: a column must have at least one cell");
+	cellsToColumnsImpl(cells, std::integral_constant<size_t, CellsPerColumn>(), out);
+}
+
+//Runtime cells per column. Common powers of two are dispatched to the compile-time versions
+template <typename Out>
+inline void cellsToColumns(const std::vector<UInt>& cells, size_t cells_per_column, Out& out)
+{
+	switch(cells_per_column) {
+		case 1: return cellsToColumns<1>(cells, out);
+		case 2: return cellsToColumns<2>(cells, out);
+		case 4: return cellsToColumns<4>(cells, out);
+		case 8: return cellsToColumns<8>(cells, out);
+		case 16: return cellsToColumns<16>(cells, out);
+		case 32: return cellsToColumns<32>(cells, out);
+		case 64: return cellsToColumns<64>(cells, out);
+	}
+	cellsToColumnsImpl(cells, cells_per_column, out);
+}
+
 //Converts container from one to another
 template<typename ResType, typename InType>
 inline ResType as(const InType& shape)
@@ -83,6 +490,16 @@ std::string vectorToString(const V& v)
 	return str;
 }
 
+//Throws unless t has the shape input_shape. owner names the layer in the message
+inline void checkInputShape(const std::vector<size_t>& input_shape, const xt::xarray<bool>& t, const std::string& owner)
+{
+	auto in_shape = t.shape();
+	if(std::equal(input_shape.begin(), input_shape.end(), in_shape.begin(), in_shape.end()) == false) {
+		throw std::runtime_error(owner + ": expecting input shape " + vectorToString(input_shape)
+			+ ", but get " + vectorToString(in_shape));
+	}
+}
+
 struct HTMLayerBase
 {
 	HTMLayerBase() = default;
@@ -107,7 +524,7 @@ struct HTMLayerBase
 		return compute(t, false);
 	}
 	
-	size_t inputSize()
+	size_t inputSize() const
 	{
 		size_t s = 1;
 		for(auto v : input_shape)
@@ -115,7 +532,7 @@ struct HTMLayerBase
 		return s;
 	}
 	
-	size_t outputSize()
+	size_t outputSize() const
 	{
 		size_t s = 1;
 		for(auto v : output_shape)
@@ -126,6 +543,60 @@ struct HTMLayerBase
 	virtual void reset() {}
 };
 
+//Input buffer of the nupic wrappers, filled either from a dense SDR or from the indices of the on
+//bits. A sparse fill following a sparse fill only clears the bits set by the previous one instead
+//of the whole buffer. T is the element type the wrapped algorithm reads
+template <typename T>
+struct SparseInputBuffer
+{
+	//Clears the buffer if its size changes
+	void resize(size_t n)
+	{
+		if(values.size() != n) {
+			values.assign(n, 0);
+			is_sparse = false;
+		}
+	}
+
+	void assign(const bool* dense)
+	{
+		for(size_t i=0;i<values.size();i++)
+			values[i] = dense[i];
+		last_active.clear();
+		is_sparse = false;
+	}
+
+	//owner prefixes the error message. All indices are checked before anything is written, so a
+	//bad index leaves the buffer as it was
+	void assign(const std::vector<UInt>& active, const char* owner)
+	{
+		for(auto i : active) {
+			if(i >= values.size())
+				throw std::runtime_error(std::string(owner) + ": input index " + std::to_string(i)
+					+ " out of range. Input size is " + std::to_string(values.size()));
+		}
+		if(is_sparse == false)
+			std::fill(values.begin(), values.end(), 0);
+		else {
+			for(auto i : last_active)
+				values[i] = 0;
+		}
+		for(auto i : active)
+			values[i] = 1;
+		last_active.assign(active.begin(), active.end());
+		is_sparse = true;
+	}
+
+	T* data() {return values.data();}
+	size_t size() const {return values.size();}
+	T operator[] (size_t i) const {return values[i];}
+
+	std::vector<T> values;
+	//values holds exactly the bits in last_active when is_sparse is true
+	std::vector<UInt> last_active;
+	bool is_sparse = false;
+};
+
 struct SpatialPooler : public HTMLayerBase
 {
 	SpatialPooler() = default;
@@ -137,23 +608,52 @@ struct SpatialPooler : public HTMLayerBase
 	}
 	
 	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+	{
+		xt::xarray<bool> res = xt::zeros<bool>(output_shape);
+		compute(t, learn, res);
+		return res;
+	}
+
+	//Writes the result into out, which is only reallocated if it has the wrong size
+	void compute(const xt::xarray<bool>& t, bool learn, xt::xarray<bool>& out)
 	{
 		auto in_shape = t.shape();
 		if(std::equal(input_shape.begin(), input_shape.end(), in_shape.begin(), in_shape.end()) == false) {
 			throw std::runtime_error("SpatialPooler: expecting input shape " + vectorToString(input_shape)
 				+ ", but get " + vectorToString(in_shape));
 		}
-		std::vector<UInt> in(inputSize());
-		std::vector<UInt> out(outputSize());
-		for(size_t i=0;i<t.size();i++)
-			in[i] = t[i];
-		
-		sp.compute(in.data(), learn, out.data());
-		
-		xt::xarray<bool> res = xt::zeros<bool>(output_shape);
-		for(size_t i=0;i<out.size();i++)
-			res[i] = out[i];
-		return res;
+		prepareBuffers();
+		in_buffer.assign(t.data());
+
+		sp.compute(in_buffer.data(), learn, out_buffer.data());
+
+		if(out.size() != out_buffer.size())
+			out = xt::zeros<bool>(output_shape);
+		std::copy(out_buffer.begin(), out_buffer.end(), out.begin());
+	}
+
+	//Sparse path. active_inputs are the indices of the on input bits and the indices of the active
+	//columns are written into active_columns. Only the input bits that changed since the previous
+	//call are touched and no memory is allocated once the buffers are warm
+	void compute(const std::vector<UInt>& active_inputs, bool learn, std::vector<UInt>& active_columns)
+	{
+		prepareBuffers();
+		in_buffer.assign(active_inputs, "SpatialPooler");
+
+		sp.compute(in_buffer.data(), learn, out_buffer.data());
+
+		active_columns.clear();
+		for(size_t i=0;i<out_buffer.size();i++) {
+			if(out_buffer[i] != 0)
+				active_columns.push_back(i);
+		}
+	}
+
+	std::vector<UInt> compute(const std::vector<UInt>& active_inputs, bool learn)
+	{
+		std::vector<UInt> active_columns;
+		compute(active_inputs, learn, active_columns);
+		return active_columns;
 	}
 
 	NuPIC::SpatialPooler* operator-> ()
@@ -167,130 +667,1649 @@ struct SpatialPooler : public HTMLayerBase
 	}
 	
 	NuPIC::SpatialPooler sp;
+
+protected:
+	void prepareBuffers()
+	{
+		in_buffer.resize(inputSize());
+		if(out_buffer.size() != outputSize())
+			out_buffer.resize(outputSize());
+	}
+
+	//Reused between calls
+	SparseInputBuffer<UInt> in_buffer;
+	std::vector<UInt> out_buffer;
 };
 
-struct TemporalPooler : public HTMLayerBase
+//SpatialPooler implemented natively on packed bits. Each column keeps its connected synapses as a
+//bitmask over the input space, so computing the overlap of a column is an AND+popcount against the
+//packed input. Parameters and learning rules follow nupic's SpatialPooler defaults with global
+//inhibition. Topology (the potential pool of a column) is computed over the flattened input and
+//column indices with wrap around.
+struct PackedSpatialPooler : public HTMLayerBase
 {
-	TemporalPooler() = default;
-	TemporalPooler(std::vector<size_t> inDim, size_t numCol)
-		: HTMLayerBase(inDim, inDim), colInTP(numCol)
-		, tp(inputSize(), colInTP, 6, 6, 15, .1, .21, 0.23, 1.0, .1, .1, 0.002,
-			false, 42, true, false)
+	PackedSpatialPooler() = default;
+	PackedSpatialPooler(std::vector<size_t> inDim, std::vector<size_t> outDim, size_t potential_radius=16, float potential_pct=0.5
+		, size_t num_active_columns=10, size_t stimulus_threshold=0, float syn_perm_inactive_dec=0.008, float syn_perm_active_inc=0.05
+		, float syn_perm_connected=0.1, float boost_strength=0, unsigned int seed=1)
+		: HTMLayerBase(inDim, outDim), num_active_columns(num_active_columns), stimulus_threshold(stimulus_threshold)
+		, syn_perm_inactive_dec(syn_perm_inactive_dec), syn_perm_active_inc(syn_perm_active_inc)
+		, syn_perm_connected(syn_perm_connected), boost_strength(boost_strength), rng(seed)
 	{
+		num_inputs = inputSize();
+		num_columns = outputSize();
+		if(num_inputs == 0 || num_columns == 0)
+			throw std::runtime_error("PackedSpatialPooler: input and column dimensions must not be empty");
+		num_words = PackedSDR::numWords(num_inputs);
+		syn_perm_trim_threshold = syn_perm_active_inc/2;
+		syn_perm_below_stimulus_inc = syn_perm_connected/10;
+
+		std::uniform_real_distribution<float> dist(0, 1);
+		connected.assign(num_columns*num_words, 0);
+		potential_begin.assign(1, 0);
+		std::vector<UInt> neighborhood;
+		for(size_t c=0;c<num_columns;c++) {
+			//Same column to input mapping as nupic's mapColumn_
+			size_t center = (size_t)((c+0.5)*((double)num_inputs/num_columns));
+			neighborhood.clear();
+			if(2*potential_radius+1 >= num_inputs) {
+				for(size_t i=0;i<num_inputs;i++)
+					neighborhood.push_back(i);
+			}
+			else {
+				for(size_t i=0;i<2*potential_radius+1;i++)
+					neighborhood.push_back((center+num_inputs-potential_radius+i)%num_inputs);
+			}
+			size_t num_potential = std::round(neighborhood.size()*potential_pct);
+			std::shuffle(neighborhood.begin(), neighborhood.end(), rng);
+			std::sort(neighborhood.begin(), neighborhood.begin()+num_potential);
+
+			for(size_t i=0;i<num_potential;i++) {
+				float perm = dist(rng) < 0.5f ? syn_perm_connected + (1-syn_perm_connected)*dist(rng)
+					: syn_perm_connected*dist(rng);
+				potential_index.push_back(neighborhood[i]);
+				permanences.push_back(perm);
+			}
+			potential_begin.push_back(potential_index.size());
+			updatePermanencesForColumn(c, true);
+		}
+
+		tie_breaker.resize(num_columns);
+		for(auto& t : tie_breaker)
+			t = 0.01f*dist(rng);
+		boost_factors.assign(num_columns, 1.f);
+		overlap_duty_cycles.assign(num_columns, 0.f);
+		active_duty_cycles.assign(num_columns, 0.f);
+		min_overlap_duty_cycles.assign(num_columns, 0.f);
+		overlaps.resize(num_columns);
+		candidates.reserve(num_columns);
+		input = PackedSDR(num_inputs);
 	}
-	
+
 	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+	{
+		xt::xarray<bool> res = xt::zeros<bool>(output_shape);
+		compute(t, learn, res);
+		return res;
+	}
+
+	//Writes the result into out, which is only reallocated if it has the wrong size
+	void compute(const xt::xarray<bool>& t, bool learn, xt::xarray<bool>& out)
 	{
 		auto in_shape = t.shape();
 		if(std::equal(input_shape.begin(), input_shape.end(), in_shape.begin(), in_shape.end()) == false) {
-			throw std::runtime_error("TemporalPooler: expecting input shape " + vectorToString(input_shape)
+			throw std::runtime_error("PackedSpatialPooler: expecting input shape " + vectorToString(input_shape)
 				+ ", but get " + vectorToString(in_shape));
 		}
-		std::vector<Real> in(t.begin(), t.end());
-		std::vector<Real> out(t.size()*colInTP);
-		xt::xarray<bool> res = xt::zeros<bool>(output_shape);
-		
-		tp.compute(in.data(), out.data(), true, learn);
-		
-		//Convert output into SDR
-		for(size_t i=0;i<out.size()/colInTP;i++)
-			res[i] = out[i*colInTP];
-		return res;
+		input.pack(t);
+		computePacked(learn);
+
+		if(out.size() != num_columns)
+			out = xt::zeros<bool>(output_shape);
+		else
+			std::fill(out.begin(), out.end(), false);
+		bool* ptr = out.data();
+		for(auto c : active_columns)
+			ptr[c] = true;
 	}
-	NuPIC::Cells4* operator-> ()
+
+	//Sparse path. active_inputs are the indices of the on input bits and the sorted indices of the
+	//active columns are written into active_columns
+	void compute(const std::vector<UInt>& active_inputs, bool learn, std::vector<UInt>& active)
 	{
-		return &tp;
+		input.clear();
+		for(auto i : active_inputs) {
+			if(i >= num_inputs)
+				throw std::runtime_error("PackedSpatialPooler: input index " + std::to_string(i)
+					+ " out of range. Input size is " + std::to_string(num_inputs));
+			input.set(i);
+		}
+		computePacked(learn);
+		active.assign(active_columns.begin(), active_columns.end());
 	}
 
-	const NuPIC::Cells4* operator-> () const
+	std::vector<UInt> compute(const std::vector<UInt>& active_inputs, bool learn)
 	{
-		return &tp;
+		std::vector<UInt> active;
+		compute(active_inputs, learn, active);
+		return active;
 	}
-	
-	void reset()
+
+	//Packed path. The input must have inputSize() bits
+	const std::vector<UInt>& compute(const PackedSDR& in, bool learn)
 	{
-		tp.reset();
+		if(in.size() != num_inputs)
+			throw std::runtime_error("PackedSpatialPooler: expecting " + std::to_string(num_inputs)
+				+ " input bits, but get " + std::to_string(in.size()));
+		input.words.assign(in.words.begin(), in.words.end());
+		computePacked(learn);
+		return active_columns;
 	}
-	
-	size_t colInTP;
-	NuPIC::Cells4 tp;
-};
 
-struct TemporalMemory : public HTMLayerBase
-{
-	TemporalMemory() = default;
-	TemporalMemory(std::vector<size_t> in_dim, size_t num_col, size_t max_segments_per_cell=255, size_t max_synapses_per_segment=255)
-		: HTMLayerBase(in_dim, in_dim), col_in_tp(num_col)
+	size_t numColumns() const {return num_columns;}
+	size_t numInputs() const {return num_inputs;}
+	size_t numActiveColumns() const {return std::min(num_active_columns, num_columns);}
+	void setNumActiveColumns(size_t n) {num_active_columns = n;}
+
+	//Raw overlap of each column in the last step
+	const std::vector<UInt>& getOverlaps() const {return overlaps;}
+	const std::vector<float>& getActiveDutyCycles() const {return active_duty_cycles;}
+	const std::vector<float>& getBoostFactors() const {return boost_factors;}
+	const std::vector<UInt>& getActiveColumns() const {return active_columns;}
+
+	//Splits the columns into blocks of block_columns columns and processes the blocks on pool.
+	//By default a block's connected masks fit in 32KB of L1 cache. Every column is owned by exactly
+	//one block, so blocks learn without sharing writes. compute() must not be called from a task
+	//running on the same pool
+	void enableParallel(ThreadPool& thread_pool = defaultThreadPool(), size_t block_size = 0)
 	{
-		std::vector<UInt> in_size = as<std::vector<UInt>>(in_dim);
-		tm = NuPIC::TemporalMemory(in_size, num_col, 13, 0.21, 0.5, 10, 20, 0.1, 0.1, 0, 42, max_segments_per_cell, max_synapses_per_segment, true);
+		pool = &thread_pool;
+		block_columns = block_size != 0 ? block_size : std::max<size_t>(64, 32*1024/(num_words*sizeof(uint64_t)));
 	}
-	
-	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+
+	void disableParallel()
 	{
-		auto in_shape = t.shape();
-		if(std::equal(input_shape.begin(), input_shape.end(), in_shape.begin(), in_shape.end()) == false) {
-			throw std::runtime_error("Temporalmemory: expecting input shape " + vectorToString(input_shape)
-				+ ", but get " + vectorToString(in_shape));
-		}
-		std::vector<UInt> cols = sparsify(t);
-		xt::xarray<bool> tp_output = xt::zeros<bool>(t.shape());
-		tm.compute(cols.size(), cols.data(), learn);
-		auto next = tm.getPredictiveCells();
-		for(auto idx : next)
-			tp_output[idx/col_in_tp] = true;
-		return tp_output;
+		pool = nullptr;
 	}
 
-	NuPIC::TemporalMemory* operator-> ()
+	bool isParallel() const {return pool != nullptr;}
+
+	size_t connectedCount(size_t column) const
 	{
-		return &tm;
+		size_t s = 0;
+		for(size_t i=0;i<num_words;i++)
+			s += popcount(connected[column*num_words+i]);
+		return s;
 	}
 
-	const NuPIC::TemporalMemory* operator-> () const
+protected:
+	void computePacked(bool learn)
 	{
-		return &tm;
+		iteration++;
+		size_t num_blocks = numBlocks();
+		if(block_candidates.size() != num_blocks)
+			block_candidates.resize(num_blocks);
+		forEachBlock([this](size_t block, size_t begin, size_t end) {
+			for(size_t c=begin;c<end;c++)
+				overlaps[c] = overlap(connected.data()+c*num_words, input.data(), num_words);
+			selectCandidates(begin, end, block_candidates[block]);
+		});
+		inhibitColumns();
+		if(learn == false)
+			return;
+
+		forEachBlock([this](size_t, size_t begin, size_t end) {
+			learnColumns(begin, end);
+		});
+		if(iteration%update_period == 0)
+			updateMinDutyCycles();
 	}
-	
-	void reset()
+
+	size_t numBlocks() const
 	{
-		tm.reset();
+		if(pool == nullptr)
+			return 1;
+		return (num_columns+block_columns-1)/block_columns;
 	}
-	
-	size_t col_in_tp;
-	NuPIC::TemporalMemory tm;
-};
-//Encoders
 
-//Your standard ScalarEncoder.
-struct ScalarEncoder
-{
-	ScalarEncoder() = default;
-	ScalarEncoder(float minval, float maxval, size_t encode_len, size_t width)
-		: min_val(minval), max_val(maxval), encode_length(encode_len), sdr_length(width)
+	//Calls f(block, begin, end) for every block of columns. Blocks run in parallel in parallel mode
+	template <typename F>
+	void forEachBlock(F f)
 	{
-		if(min_val > max_val)
-			throw std::runtime_error("ScalarEncoder error: min_val > max_val");
+		if(pool == nullptr) {
+			f(0, 0, num_columns);
+			return;
+		}
+		parallelFor(0, numBlocks(), 1, [&](size_t first, size_t last) {
+			for(size_t b=first;b<last;b++)
+				f(b, b*block_columns, std::min((b+1)*block_columns, num_columns));
+		}, *pool);
 	}
 
-	xt::xarray<bool> operator() (float value) const
+	//Equal scores are broken by column index so the winners do not depend on the block layout
+	static bool betterCandidate(const std::pair<float, UInt>& a, const std::pair<float, UInt>& b)
 	{
-		return encode(value);
+		return a.first > b.first || (a.first == b.first && a.second < b.second);
 	}
 
-	xt::xarray<bool> encode(float value) const
+	//Keeps the k best columns of [begin, end) in out
+	void selectCandidates(size_t begin, size_t end, std::vector<std::pair<float, UInt>>& out) const
+	{
+		out.clear();
+		for(size_t c=begin;c<end;c++) {
+			if(overlaps[c] >= stimulus_threshold)
+				out.emplace_back(overlaps[c]*boost_factors[c]+tie_breaker[c], c);
+		}
+		size_t k = std::min(numActiveColumns(), out.size());
+		std::nth_element(out.begin(), out.begin()+k, out.end()
+			, betterCandidate);
+		out.resize(k);
+	}
+
+	//Global inhibition. The k columns with the highest boosted overlaps win. The global top k is
+	//the top k of the union of every block's top k
+	void inhibitColumns()
+	{
+		const std::vector<std::pair<float, UInt>>* winners = &block_candidates[0];
+		if(block_candidates.size() > 1) {
+			candidates.clear();
+			for(const auto& block : block_candidates)
+				candidates.insert(candidates.end(), block.begin(), block.end());
+			size_t k = std::min(numActiveColumns(), candidates.size());
+			std::nth_element(candidates.begin(), candidates.begin()+k, candidates.end()
+				, betterCandidate);
+			candidates.resize(k);
+			winners = &candidates;
+		}
+		active_columns.resize(winners->size());
+		for(size_t i=0;i<winners->size();i++)
+			active_columns[i] = (*winners)[i].second;
+		std::sort(active_columns.begin(), active_columns.end());
+	}
+
+	//All learning updates of columns [begin, end). Only touches the state of those columns
+	void learnColumns(size_t begin, size_t end)
+	{
+		auto first = std::lower_bound(active_columns.begin(), active_columns.end(), begin);
+		auto last = std::lower_bound(first, active_columns.end(), end);
+		for(auto it=first;it!=last;it++)
+			adaptSynapses(*it);
+
+		float period = std::min(iteration, duty_cycle_period);
+		float decay = (period-1)/period;
+		for(size_t c=begin;c<end;c++) {
+			overlap_duty_cycles[c] = overlap_duty_cycles[c]*decay + (overlaps[c] > 0 ? 1.f/period : 0.f);
+			active_duty_cycles[c] *= decay;
+		}
+		for(auto it=first;it!=last;it++)
+			active_duty_cycles[*it] += 1.f/period;
+
+		//Bump up weak columns
+		for(size_t c=begin;c<end;c++) {
+			if(overlap_duty_cycles[c] >= min_overlap_duty_cycles[c])
+				continue;
+			for(size_t s=potential_begin[c];s<potential_begin[c+1];s++)
+				setPermanence(c, s, permanences[s]+syn_perm_below_stimulus_inc);
+		}
+
+		if(boost_strength != 0) {
+			float target_density = (float)numActiveColumns()/num_columns;
+			for(size_t c=begin;c<end;c++)
+				boost_factors[c] = std::exp(-(active_duty_cycles[c]-target_density)*boost_strength);
+		}
+	}
+
+	void setPermanence(size_t column, size_t synapse, float perm)
+	{
+		perm = std::clamp(perm, 0.f, 1.f);
+		if(perm < syn_perm_trim_threshold)
+			perm = 0;
+		permanences[synapse] = perm;
+		size_t idx = potential_index[synapse];
+		uint64_t& word = connected[column*num_words+idx/64];
+		uint64_t bit = (uint64_t)1 << (idx%64);
+		word = perm >= syn_perm_connected ? word|bit : word&~bit;
+	}
+
+	void adaptSynapses(size_t column)
+	{
+		for(size_t s=potential_begin[column];s<potential_begin[column+1];s++)
+			permanences[s] += input.test(potential_index[s]) ? syn_perm_active_inc : -syn_perm_inactive_dec;
+		updatePermanencesForColumn(column, true);
+	}
+
+	//Same as nupic's updatePermanencesForColumn_. Optionally raises the column to stimulus_threshold
+	//connected synapses, then clips and trims the permanences and refreshes the connected mask.
+	//Trimming has to wait until the raise is done, otherwise increments below the trim threshold
+	//are undone every round and a column starting at zero never gets connected
+	void updatePermanencesForColumn(size_t column, bool raise)
+	{
+		size_t begin = potential_begin[column];
+		size_t end = potential_begin[column+1];
+		if(raise && stimulus_threshold != 0 && end-begin >= stimulus_threshold) {
+			while(true) {
+				size_t num_connected = 0;
+				for(size_t s=begin;s<end;s++)
+					num_connected += permanences[s] >= syn_perm_connected;
+				if(num_connected >= stimulus_threshold)
+					break;
+				for(size_t s=begin;s<end;s++)
+					permanences[s] += syn_perm_below_stimulus_inc;
+			}
+		}
+		for(size_t s=begin;s<end;s++)
+			setPermanence(column, s, permanences[s]);
+	}
+
+	void updateMinDutyCycles()
+	{
+		float max_duty_cycle = *std::max_element(overlap_duty_cycles.begin(), overlap_duty_cycles.end());
+		std::fill(min_overlap_duty_cycles.begin(), min_overlap_duty_cycles.end(), min_pct_overlap_duty_cycles*max_duty_cycle);
+	}
+
+	size_t num_inputs = 0;
+	size_t num_columns = 0;
+	size_t num_words = 0;
+
+	size_t num_active_columns = 10;
+	size_t stimulus_threshold = 0;
+	float syn_perm_inactive_dec = 0.008;
+	float syn_perm_active_inc = 0.05;
+	float syn_perm_connected = 0.1;
+	float syn_perm_trim_threshold = 0.025;
+	float syn_perm_below_stimulus_inc = 0.01;
+	float boost_strength = 0;
+	float min_pct_overlap_duty_cycles = 0.001;
+	size_t duty_cycle_period = 1000;
+	size_t update_period = 50;
+	size_t iteration = 0;
+
+	//Potential synapses of column c are [potential_begin[c], potential_begin[c+1]) of
+	//potential_index and permanences. connected holds num_words words per column
+	std::vector<size_t> potential_begin;
+	std::vector<UInt> potential_index;
+	std::vector<float> permanences;
+	std::vector<uint64_t> connected;
+
+	std::vector<float> tie_breaker;
+	std::vector<float> boost_factors;
+	std::vector<float> overlap_duty_cycles;
+	std::vector<float> active_duty_cycles;
+	std::vector<float> min_overlap_duty_cycles;
+
+	//Reused between calls
+	PackedSDR input;
+	std::vector<UInt> overlaps;
+	std::vector<std::pair<float, UInt>> candidates;
+	std::vector<std::vector<std::pair<float, UInt>>> block_candidates;
+	std::vector<UInt> active_columns;
+
+	//Parallel mode when not null
+	ThreadPool* pool = nullptr;
+	size_t block_columns = 0;
+
+	std::mt19937 rng;
+};
+
+struct TemporalPooler : public HTMLayerBase
+{
+	TemporalPooler() = default;
+	TemporalPooler(std::vector<size_t> inDim, size_t numCol)
+		: HTMLayerBase(inDim, inDim), colInTP(numCol)
+		, tp(inputSize(), colInTP, 6, 6, 15, .1, .21, 0.23, 1.0, .1, .1, 0.002,
+			false, 42, true, false)
+	{
+	}
+	
+	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+	{
+		xt::xarray<bool> res = xt::zeros<bool>(output_shape);
+		compute(t, learn, res);
+		return res;
+	}
+
+	//Writes the result into out, which is only reallocated if it has the wrong size
+	void compute(const xt::xarray<bool>& t, bool learn, xt::xarray<bool>& out)
+	{
+		auto in_shape = t.shape();
+		if(std::equal(input_shape.begin(), input_shape.end(), in_shape.begin(), in_shape.end()) == false) {
+			throw std::runtime_error("TemporalPooler: expecting input shape " + vectorToString(input_shape)
+				+ ", but get " + vectorToString(in_shape));
+		}
+		prepareBuffers();
+		in_buffer.assign(t.data());
+
+		tp.compute(in_buffer.data(), out_buffer.data(), true, learn);
+
+		if(out.size() != in_buffer.size())
+			out = xt::zeros<bool>(output_shape);
+		//Convert output into SDR
+		bool* res = out.data();
+		for(size_t i=0;i<in_buffer.size();i++)
+			res[i] = out_buffer[i*colInTP];
+	}
+
+	//Sparse path. active_inputs are the indices of the on input bits and the indices of the on
+	//columns are written into active_columns. Only the inputs that changed since the previous call
+	//are written and no memory is allocated once the buffers are warm
+	void compute(const std::vector<UInt>& active_inputs, bool learn, std::vector<UInt>& active_columns)
+	{
+		prepareBuffers();
+		in_buffer.assign(active_inputs, "TemporalPooler");
+
+		tp.compute(in_buffer.data(), out_buffer.data(), true, learn);
+
+		active_columns.clear();
+		for(size_t i=0;i<in_buffer.size();i++) {
+			if(out_buffer[i*colInTP] != 0)
+				active_columns.push_back(i);
+		}
+	}
+
+	std::vector<UInt> compute(const std::vector<UInt>& active_inputs, bool learn)
+	{
+		std::vector<UInt> active_columns;
+		compute(active_inputs, learn, active_columns);
+		return active_columns;
+	}
+
+	NuPIC::Cells4* operator-> ()
+	{
+		return &tp;
+	}
+
+	const NuPIC::Cells4* operator-> () const
+	{
+		return &tp;
+	}
+	
+	void reset()
+	{
+		tp.reset();
+	}
+	
+	size_t colInTP;
+	NuPIC::Cells4 tp;
+
+protected:
+	void prepareBuffers()
+	{
+		in_buffer.resize(inputSize());
+		if(out_buffer.size() != inputSize()*colInTP)
+			out_buffer.resize(inputSize()*colInTP);
+	}
+
+	//Reused between calls
+	SparseInputBuffer<Real> in_buffer;
+	std::vector<Real> out_buffer;
+};
+
+//nupic's TemporalMemory whose active cells can be restored, so it can be brought up to date after
+//steps it did not run
+struct RestorableTemporalMemory : public NuPIC::TemporalMemory
+{
+	using NuPIC::TemporalMemory::TemporalMemory;
+
+	//Makes cells the active cells and recomputes the active and matching segments from them
+	void restoreActiveCells(const std::vector<UInt>& cells)
+	{
+		activeCells_.assign(cells.begin(), cells.end());
+		activateDendrites(false);
+	}
+};
+
+struct TemporalMemory : public HTMLayerBase
+{
+	TemporalMemory() = default;
+	TemporalMemory(std::vector<size_t> in_dim, size_t num_col, size_t max_segments_per_cell=255, size_t max_synapses_per_segment=255)
+		: HTMLayerBase(in_dim, in_dim), col_in_tp(num_col)
+	{
+		std::vector<UInt> in_size = as<std::vector<UInt>>(in_dim);
+		tm = RestorableTemporalMemory(in_size, num_col, 13, 0.21, 0.5, 10, 20, 0.1, 0.1, 0, 42, max_segments_per_cell, max_synapses_per_segment, true);
+	}
+	
+	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+	{
+		checkInputShape(input_shape, t, "Temporalmemory");
+		std::vector<UInt> cols = sparsify(t);
+		xt::xarray<bool> tp_output = xt::zeros<bool>(t.shape());
+		step(cols.data(), cols.size(), learn);
+		for(auto idx : predictiveCells())
+			tp_output[idx/col_in_tp] = true;
+		return tp_output;
+	}
+
+	//Runs a step and returns its raw anomaly score, computed from the predictive cells the TM kept
+	//from the previous step. Callers do not need to keep the last prediction around.
+	//active_columns must be sorted
+	float computeWithAnomaly(const std::vector<UInt>& active_columns, bool learn)
+	{
+		float score = anomaly(active_columns, predictiveCells(), col_in_tp);
+		step(active_columns.data(), active_columns.size(), learn);
+		return score;
+	}
+
+	float computeWithAnomaly(const xt::xarray<bool>& t, bool learn)
+	{
+		checkInputShape(input_shape, t, "Temporalmemory");
+		return computeWithAnomaly(sparsify(t), learn);
+	}
+
+	//Same as above and writes the column level prediction for the next step into prediction
+	float computeWithAnomaly(const xt::xarray<bool>& t, bool learn, xt::xarray<bool>& prediction)
+	{
+		float score = computeWithAnomaly(t, learn);
+		if(prediction.size() != t.size())
+			prediction = xt::zeros<bool>(t.shape());
+		else
+			std::fill(prediction.begin(), prediction.end(), false);
+		bool* ptr = prediction.data();
+		for(auto idx : predictiveCells())
+			ptr[idx/col_in_tp] = true;
+		return score;
+	}
+
+	//Columns predicted for the next step as a sorted list without duplicates
+	void predictedColumns(std::vector<UInt>& columns) const
+	{
+		cellsToColumns(predictiveCells(), col_in_tp, columns);
+	}
+
+	//Sets the bits of the predicted columns in out, which must have inputSize() bits
+	void predictedColumns(PackedSDR& out) const
+	{
+		checkPackedSize(out);
+		cellsToColumns(predictiveCells(), col_in_tp, out);
+	}
+
+	//Versions for a number of cells per column known at compile time
+	template <size_t CellsPerColumn>
+	void predictedColumns(std::vector<UInt>& columns) const
+	{
+		checkCellsPerColumn(CellsPerColumn);
+		cellsToColumns<CellsPerColumn>(predictiveCells(), columns);
+	}
+
+	template <size_t CellsPerColumn>
+	void predictedColumns(PackedSDR& out) const
+	{
+		checkCellsPerColumn(CellsPerColumn);
+		checkPackedSize(out);
+		cellsToColumns<CellsPerColumn>(predictiveCells(), out);
+	}
+
+	//Inference only mode. When enabled, steps with learn=false run on a compact read-only copy of
+	//the connected synapses instead of nupic's TemporalMemory, skipping winner cell and matching
+	//segment bookkeeping. The predictions are the same. The copy is rebuilt on the first inference
+	//step after a learning step or after the connected permanence or activation threshold changed.
+	//
+	//nupic's TemporalMemory does not see the inference-only steps. Before the next step that runs
+	//on it, sync() hands it the active cells of the second to last of them and reruns the last one,
+	//so learning resumes in the same sequence context. Only random tie breaks between bursting
+	//cells may differ, as tm's random generator does not advance during inference-only steps.
+	void setFrozenInference(bool enable)
+	{
+		frozen_inference = enable;
+	}
+
+	bool frozenInference() const {return frozen_inference;}
+
+	//Brings tm up to date after inference-only steps. Done by the next step that runs on tm, call it
+	//yourself before driving tm directly
+	void sync()
+	{
+		if(frozen_running == false)
+			return;
+		tm.restoreActiveCells(prev_active_cells);
+		tm.compute(last_columns.size(), last_columns.data(), false);
+		frozen_running = false;
+	}
+
+	//Drops the compact copy. Needed after changing the connections of tm directly, e.g. by
+	//learning through tm->compute() or loading a saved TM
+	void invalidateFrozen()
+	{
+		frozen_valid = false;
+	}
+
+	NuPIC::TemporalMemory* operator-> ()
+	{
+		return &tm;
+	}
+
+	const NuPIC::TemporalMemory* operator-> () const
+	{
+		return &tm;
+	}
+	
+	void reset()
+	{
+		tm.reset();
+		predictive_cells.clear();
+		frozen_running = false;
+	}
+	
+	size_t col_in_tp;
+	RestorableTemporalMemory tm;
+
+protected:
+	void checkCellsPerColumn(size_t cells_per_column) const
+	{
+		if(cells_per_column != col_in_tp)
+			throw std::runtime_error("Temporalmemory: the TM has " + std::to_string(col_in_tp)
+				+ " cells per column, but " + std::to_string(cells_per_column) + " is requested");
+	}
+
+	void checkPackedSize(const PackedSDR& out) const
+	{
+		if(out.size() != inputSize())
+			throw std::runtime_error("Temporalmemory: expecting a PackedSDR of " + std::to_string(inputSize())
+				+ " bits, but get " + std::to_string(out.size()));
+	}
+
+	//Predictive cells after the last step. Refreshed from tm unless the last step ran on the
+	//compact copy, so steps run directly through tm->compute() are seen as well
+	const std::vector<UInt>& predictiveCells() const
+	{
+		if(frozen_running == false)
+			predictive_cells = tm.getPredictiveCells();
+		return predictive_cells;
+	}
+
+	//Runs one step over the sorted active columns
+	void step(const UInt* columns, size_t num_columns, bool learn)
+	{
+		if(learn || frozen_inference == false) {
+			sync();
+			if(learn)
+				frozen_valid = false;
+			tm.compute(num_columns, columns, learn);
+			return;
+		}
+
+		if(frozen_valid == false || frozen.connected_permanence != tm.getConnectedPermanence()
+			|| frozen.source_threshold != tm.getActivationThreshold())
+			buildFrozen();
+		if(frozen_running == false) {
+			predictive_cells = tm.getPredictiveCells();
+			active_cells = tm.getActiveCells();
+		}
+		frozen_running = true;
+		std::swap(prev_active_cells, active_cells);
+		last_columns.assign(columns, columns+num_columns);
+
+		//Predicted columns activate their predictive cells, the others burst
+		active_cells.clear();
+		auto p = predictive_cells.begin();
+		for(size_t i=0;i<num_columns;i++) {
+			UInt first_cell = columns[i]*col_in_tp;
+			while(p != predictive_cells.end() && *p < first_cell)
+				p++;
+			size_t num_active = active_cells.size();
+			while(p != predictive_cells.end() && *p < first_cell+col_in_tp)
+				active_cells.push_back(*p++);
+			if(active_cells.size() == num_active) {
+				for(UInt c=first_cell;c<first_cell+col_in_tp;c++)
+					active_cells.push_back(c);
+			}
+		}
+
+		//A cell becomes predictive once any of its segments reaches the activation threshold
+		predictive_cells.clear();
+		for(auto cell : active_cells) {
+			for(size_t i=frozen.synapse_begin[cell];i<frozen.synapse_begin[cell+1];i++) {
+				UInt segment = frozen.synapse_segment[i];
+				UInt count = ++frozen.num_active[segment];
+				if(count == 1)
+					frozen.touched.push_back(segment);
+				if(count == frozen.activation_threshold)
+					predictive_cells.push_back(frozen.segment_cell[segment]);
+			}
+		}
+		for(auto segment : frozen.touched)
+			frozen.num_active[segment] = 0;
+		frozen.touched.clear();
+		std::sort(predictive_cells.begin(), predictive_cells.end());
+		predictive_cells.erase(std::unique(predictive_cells.begin(), predictive_cells.end()), predictive_cells.end());
+	}
+
+	//Compacts the connected synapses of segments that can ever become active into a CSR indexed by
+	//presynaptic cell
+	void buildFrozen()
+	{
+		size_t num_cells = tm.numberOfCells();
+		auto connected_permanence = tm.getConnectedPermanence();
+		frozen.connected_permanence = connected_permanence;
+		frozen.source_threshold = tm.getActivationThreshold();
+		frozen.activation_threshold = std::max<UInt>(frozen.source_threshold, 1);
+		frozen.segment_cell.clear();
+
+		std::vector<std::pair<UInt, UInt>> edges;
+		for(UInt cell=0;cell<num_cells;cell++) {
+			for(auto segment : tm.connections.segmentsForCell(cell)) {
+				size_t first = edges.size();
+				for(auto synapse : tm.connections.synapsesForSegment(segment)) {
+					const auto& data = tm.connections.dataForSynapse(synapse);
+					if(data.permanence >= connected_permanence)
+						edges.emplace_back(data.presynapticCell, frozen.segment_cell.size());
+				}
+				if(edges.size()-first < frozen.activation_threshold) {
+					edges.resize(first);
+					continue;
+				}
+				frozen.segment_cell.push_back(cell);
+			}
+		}
+
+		frozen.synapse_begin.assign(num_cells+1, 0);
+		for(const auto& e : edges)
+			frozen.synapse_begin[e.first+1]++;
+		std::partial_sum(frozen.synapse_begin.begin(), frozen.synapse_begin.end(), frozen.synapse_begin.begin());
+		frozen.synapse_segment.resize(edges.size());
+		std::vector<size_t> cursor(frozen.synapse_begin.begin(), frozen.synapse_begin.end()-1);
+		for(const auto& e : edges)
+			frozen.synapse_segment[cursor[e.first]++] = e.second;
+
+		frozen.num_active.assign(frozen.segment_cell.size(), 0);
+		frozen.touched.clear();
+		frozen_valid = true;
+	}
+
+	//Read-only copy of the connected synapses. The segments reached by presynaptic cell c are
+	//synapse_segment[synapse_begin[c]] ... synapse_segment[synapse_begin[c+1]-1]
+	struct FrozenConnections
+	{
+		std::vector<size_t> synapse_begin;
+		std::vector<UInt> synapse_segment;
+		std::vector<UInt> segment_cell;
+		std::vector<UInt> num_active;
+		std::vector<UInt> touched;
+		UInt activation_threshold = 1;
+		//Parameters of tm the copy was built with
+		float connected_permanence = 0;
+		UInt source_threshold = 0;
+	};
+
+	//Predictive cells after the last step, sorted. Also a cache of tm's, hence mutable
+	mutable std::vector<UInt> predictive_cells;
+	std::vector<UInt> active_cells;
+	//Active cells before and columns of the last step on the compact copy, for sync()
+	std::vector<UInt> prev_active_cells;
+	std::vector<UInt> last_columns;
+	FrozenConnections frozen;
+	bool frozen_inference = false;
+	bool frozen_valid = false;
+	//The last step ran on the compact copy, so tm is out of date
+	bool frozen_running = false;
+};
+
+//TemporalMemory over a compile-time number of columns. Inputs and predictions are FixedSDR<N>,
+//so the input shape is guaranteed by the type and never checked at runtime
+template <size_t N>
+struct FixedTemporalMemory : public TemporalMemory
+{
+	FixedTemporalMemory() = default;
+	FixedTemporalMemory(size_t num_col, size_t max_segments_per_cell=255, size_t max_synapses_per_segment=255)
+		: TemporalMemory({N}, num_col, max_segments_per_cell, max_synapses_per_segment)
+	{
+		active_columns.reserve(N);
+	}
+
+	using TemporalMemory::compute;
+	using HTMLayerBase::operator();
+
+	FixedSDR<N> compute(const FixedSDR<N>& t, bool learn)
+	{
+		active_columns.clear();
+		t.forEach([this](size_t i){active_columns.push_back(i);});
+		step(active_columns.data(), active_columns.size(), learn);
+
+		FixedSDR<N> res;
+		for(auto idx : predictiveCells())
+			res.set(idx/col_in_tp);
+		return res;
+	}
+
+	FixedSDR<N> operator() (const FixedSDR<N>& t, bool learn=true) {return compute(t, learn);}
+
+protected:
+	std::vector<UInt> active_columns;
+};
+
+//Growable array of a trivially copyable type in malloc'd memory. Unlike std::vector it can give
+//unused capacity back with realloc, which shrinks the allocation in place instead of copying it
+template <typename T>
+class PoolArray
+{
+	static_assert(std::is_trivially_copyable<T>::value, "PoolArray: T must be trivially copyable");
+public:
+	PoolArray() = default;
+	PoolArray(const PoolArray& other) {*this = other;}
+	PoolArray(PoolArray&& other) noexcept {swap(other);}
+	~PoolArray() {std::free(ptr);}
+
+	PoolArray& operator= (const PoolArray& other)
+	{
+		if(this != &other) {
+			len = 0;
+			reserve(other.len);
+			if(other.len != 0)
+				std::memcpy(ptr, other.ptr, other.len*sizeof(T));
+			len = other.len;
+		}
+		return *this;
+	}
+	PoolArray& operator= (PoolArray&& other) noexcept {swap(other); return *this;}
+
+	void swap(PoolArray& other) noexcept
+	{
+		std::swap(ptr, other.ptr);
+		std::swap(len, other.len);
+		std::swap(cap, other.cap);
+	}
+
+	//New elements are value initialized
+	void resize(size_t n)
+	{
+		if(n > cap)
+			reallocate(std::max(n, cap+cap/2));
+		for(size_t i=len;i<n;i++)
+			new (ptr+i) T();
+		len = n;
+	}
+
+	void reserve(size_t n)
+	{
+		if(n > cap)
+			reallocate(n);
+	}
+
+	void push_back(const T& value)
+	{
+		if(len == cap)
+			reallocate(std::max<size_t>(cap+cap/2, 4));
+		new (ptr+len) T(value);
+		len++;
+	}
+
+	void pop_back() {len--;}
+
+	//Gives back the capacity beyond size()+headroom
+	void releaseTail(size_t headroom = 0)
+	{
+		if(cap > len+headroom)
+			reallocate(len+headroom);
+	}
+
+	size_t size() const {return len;}
+	size_t capacity() const {return cap;}
+	bool empty() const {return len == 0;}
+	T* data() {return ptr;}
+	const T* data() const {return ptr;}
+	T& operator[] (size_t i) {return ptr[i];}
+	const T& operator[] (size_t i) const {return ptr[i];}
+	T& back() {return ptr[len-1];}
+	const T& back() const {return ptr[len-1];}
+	T* begin() {return ptr;}
+	T* end() {return ptr+len;}
+	const T* begin() const {return ptr;}
+	const T* end() const {return ptr+len;}
+
+protected:
+	void reallocate(size_t n)
+	{
+		if(n == 0) {
+			std::free(ptr);
+			ptr = nullptr;
+			cap = 0;
+			return;
+		}
+		T* p = static_cast<T*>(std::realloc(ptr, n*sizeof(T)));
+		if(p == nullptr)
+			throw std::bad_alloc();
+		ptr = p;
+		cap = n;
+	}
+
+	T* ptr = nullptr;
+	size_t len = 0;
+	size_t cap = 0;
+};
+
+//TemporalMemory with compact connection storage. Runs the same algorithm as nupic's TemporalMemory
+//(with the parameters of the TemporalMemory wrapper), but stores each permanence as 8 bits (q/255)
+//and each presynaptic cell as an Index. A synapse therefore takes sizeof(Index)+1 bytes, and the
+//synapses of a segment form one contiguous block of a shared pool. Segment activity comes from
+//scanning the blocks against a bitset of the active cells. A reverse index would cost more memory
+//than the synapses themselves. By default permanence changes are rounded stochastically, so changes
+//that are not multiples of 1/255 still apply on average.
+template <typename Index = uint16_t>
+struct CompactTemporalMemory : public HTMLayerBase
+{
+	static_assert(std::is_unsigned<Index>::value, "CompactTemporalMemory: Index must be an unsigned integer type");
+
+	CompactTemporalMemory() = default;
+	CompactTemporalMemory(std::vector<size_t> in_dim, size_t num_col, size_t max_segments_per_cell=255, size_t max_synapses_per_segment=255
+		, bool stochastic_rounding=true)
+		: HTMLayerBase(in_dim, in_dim), col_in_tp(num_col), max_segments_per_cell(max_segments_per_cell)
+		, max_synapses_per_segment(max_synapses_per_segment), stochastic_rounding(stochastic_rounding), rng(42)
+	{
+		num_columns = inputSize();
+		num_cells = num_columns*col_in_tp;
+		if(num_cells == 0)
+			throw std::runtime_error("CompactTemporalMemory: the TM must have at least one cell");
+		if(num_cells-1 > std::numeric_limits<Index>::max())
+			throw std::runtime_error("CompactTemporalMemory: " + std::to_string(num_cells) + " cells do not fit in a "
+				+ std::to_string(sizeof(Index)*8) + " bit index");
+		if(max_synapses_per_segment > std::numeric_limits<uint16_t>::max())
+			throw std::runtime_error("CompactTemporalMemory: at most 65535 synapses per segment are supported");
+		cell_segments.resize(num_cells);
+		active_bits = PackedSDR(num_cells);
+	}
+
+	virtual xt::xarray<bool> compute(const xt::xarray<bool>& t, bool learn) override
+	{
+		checkInputShape(input_shape, t, "CompactTemporalMemory");
+		std::vector<UInt> cols = sparsify(t);
+		compute(cols, learn);
+		xt::xarray<bool> tp_output = xt::zeros<bool>(t.shape());
+		for(auto idx : predictive_cells)
+			tp_output[idx/col_in_tp] = true;
+		return tp_output;
+	}
+
+	//active_columns must be sorted
+	void compute(const std::vector<UInt>& active_columns, bool learn)
+	{
+		if(active_columns.empty() == false && active_columns.back() >= num_columns)
+			throw std::runtime_error("CompactTemporalMemory: column " + std::to_string(active_columns.back())
+				+ " out of range. The TM has " + std::to_string(num_columns) + " columns");
+		activateCells(active_columns, learn);
+		activateDendrites(learn);
+		if(learn && compaction_budget.count() > 0 && (compaction.running || poolHoles() > num_synapses/4))
+			compact(compaction_budget);
+	}
+
+	//Runs a step and returns its raw anomaly score from the predictive cells of the previous step
+	float computeWithAnomaly(const std::vector<UInt>& active_columns, bool learn)
+	{
+		float score = anomaly(active_columns, predictive_cells, col_in_tp);
+		compute(active_columns, learn);
+		return score;
+	}
+
+	float computeWithAnomaly(const xt::xarray<bool>& t, bool learn)
+	{
+		checkInputShape(input_shape, t, "CompactTemporalMemory");
+		return computeWithAnomaly(sparsify(t), learn);
+	}
+
+	//Runs the storage compaction for at most about budget. Live segment blocks are slid down over the
+	//holes left by destroyed and relocated segments in pool order, and permanence-zero synapses are
+	//dropped on the way. A pass can be spread over any number of calls, with compute() running in
+	//between. Every call does O(work done) so step latency stays flat. Returns true when a pass finishes.
+	//Once the pool is done, the freed tail is given back except for 1/8 headroom, and the segment
+	//table is compacted the same way: the live segment with the highest id moves into a free id, one
+	//segment per step, so dead entries anywhere in the table are reclaimed. Blocks are not reordered
+	//by cell. activateDendrites() streams the pool front to back whatever the order, and sorting
+	//would move every block on every pass for the sake of the per-segment learning updates
+	bool compact(std::chrono::microseconds budget)
+	{
+		auto deadline = std::chrono::steady_clock::now() + budget;
+		if(compaction.running == false) {
+			compaction.running = true;
+			compaction.pool_done = false;
+			compaction.next = 0;
+			compaction.write = 0;
+			compaction.blocks.clear();
+		}
+		for(size_t n=1;;n++) {
+			if(n%16 == 0 && std::chrono::steady_clock::now() >= deadline) {
+				dropFreedIds();
+				return false;
+			}
+			if(compaction.pool_done == false) {
+				//Blocks allocated during the pass are appended to pool_blocks, so they are reached too
+				if(compaction.next < pool_blocks.size()) {
+					auto [offset, segment] = pool_blocks[compaction.next++];
+					compactSegment(offset, segment);
+				}
+				else
+					finishPool();
+			}
+			else if(moveLastSegment() == false) {
+				dropFreedIds();
+				segments.releaseTail(segments.size()/8);
+				compaction.running = false;
+				return true;
+			}
+		}
+	}
+
+	//Releases all unused memory, including the headroom kept by compact()
+	void shrinkToFit()
+	{
+		presynaptic.releaseTail();
+		permanences.releaseTail();
+		segments.releaseTail();
+		pool_blocks.shrink_to_fit();
+	}
+
+	//Makes every learning step run compact() with the given budget while the pool holds more than
+	//25% holes or a pass is in progress. 0 disables it
+	void setCompactionBudget(std::chrono::microseconds budget) {compaction_budget = budget;}
+	bool isCompacting() const {return compaction.running;}
+
+	void reset()
+	{
+		active_cells.clear();
+		winner_cells.clear();
+		predictive_cells.clear();
+		active_segments.clear();
+		matching_segments.clear();
+		active_bits.clear();
+	}
+
+	//Columns predicted for the next step as a sorted list without duplicates
+	void predictedColumns(std::vector<UInt>& columns) const
+	{
+		cellsToColumns(predictive_cells, col_in_tp, columns);
+	}
+
+	//Sets the bits of the predicted columns in out, which must have inputSize() bits
+	void predictedColumns(PackedSDR& out) const
+	{
+		if(out.size() != num_columns)
+			throw std::runtime_error("CompactTemporalMemory: expecting a PackedSDR of " + std::to_string(num_columns)
+				+ " bits, but get " + std::to_string(out.size()));
+		cellsToColumns(predictive_cells, col_in_tp, out);
+	}
+
+	const std::vector<UInt>& getActiveCells() const {return active_cells;}
+	const std::vector<UInt>& getWinnerCells() const {return winner_cells;}
+	//Sorted
+	const std::vector<UInt>& getPredictiveCells() const {return predictive_cells;}
+
+	void setActivationThreshold(UInt v) {activation_threshold = v;}
+	void setMinThreshold(UInt v) {min_threshold = v;}
+	void setMaxNewSynapseCount(UInt v) {max_new_synapse_count = v;}
+	void setInitialPermanence(float v) {initial_permanence = std::round(std::clamp(v, 0.f, 1.f)*255.f);}
+	void setConnectedPermanence(float v) {connected_permanence = std::ceil(std::clamp(v, 0.f, 1.f)*255.f);}
+	void setPermanenceIncrement(float v) {permanence_increment = v;}
+	void setPermanenceDecrement(float v) {permanence_decrement = v;}
+	void setPredictedSegmentDecrement(float v) {predicted_segment_decrement = v;}
+	float getPermanenceIncrement() const {return permanence_increment;}
+	float getPermanenceDecrement() const {return permanence_decrement;}
+	float getPredictedSegmentDecrement() const {return predicted_segment_decrement;}
+
+	size_t numSegments() const {return segments.size()-free_segments.size();}
+	size_t numSynapses() const {return num_synapses;}
+	size_t numCells() const {return num_cells;}
+
+	//Bytes used by the connections, including unused pool space
+	size_t memoryUsage() const
+	{
+		size_t s = presynaptic.capacity()*sizeof(Index) + permanences.capacity()*sizeof(uint8_t)
+			+ segments.capacity()*sizeof(SegmentData) + free_segments.capacity()*sizeof(UInt)
+			+ (pool_blocks.capacity()+compaction.blocks.capacity())*sizeof(std::pair<UInt, UInt>)
+			+ cell_segments.capacity()*sizeof(std::vector<UInt>);
+		for(const auto& segs : cell_segments)
+			s += segs.capacity()*sizeof(UInt);
+		return s;
+	}
+
+	//Pool slots not owned by any live segment
+	size_t poolHoles() const {return presynaptic.size()-live_slots;}
+
+	size_t col_in_tp = 0;
+
+protected:
+	struct SegmentData
+	{
+		UInt offset = 0;
+		uint16_t size = 0;
+		uint16_t capacity = 0;
+		UInt cell = 0;
+		UInt last_used = 0;
+		//Creation order. Orders the segments of a cell independently of their ids, which change
+		//when compact() moves the segment
+		UInt ordinal = 0;
+		bool alive = false;
+	};
+
+	bool wasActive(UInt cell) const {return active_bits.test(cell);}
+	bool wasWinner(UInt cell) const {return std::binary_search(prev_winner_cells.begin(), prev_winner_cells.end(), cell);}
+	UInt columnOf(UInt segment) const {return segments[segment].cell/col_in_tp;}
+
+	void activateCells(const std::vector<UInt>& active_columns, bool learn)
+	{
+		//active_bits still holds the active cells of the previous step
+		std::swap(prev_winner_cells, winner_cells);
+		active_cells.clear();
+		winner_cells.clear();
+
+		size_t ia = 0;
+		size_t im = 0;
+		for(auto col : active_columns) {
+			while(ia < active_segments.size() && columnOf(active_segments[ia]) < col)
+				ia++;
+			while(im < matching_segments.size() && columnOf(matching_segments[im]) < col)
+				punishSegment(matching_segments[im++], learn);
+			size_t active_end = ia;
+			while(active_end < active_segments.size() && columnOf(active_segments[active_end]) == col)
+				active_end++;
+			size_t matching_end = im;
+			while(matching_end < matching_segments.size() && columnOf(matching_segments[matching_end]) == col)
+				matching_end++;
+
+			if(active_end != ia)
+				activatePredictedColumn(ia, active_end, learn);
+			else
+				burstColumn(col, im, matching_end, learn);
+			ia = active_end;
+			im = matching_end;
+		}
+		while(im < matching_segments.size())
+			punishSegment(matching_segments[im++], learn);
+	}
+
+	void activatePredictedColumn(size_t begin, size_t end, bool learn)
+	{
+		for(size_t i=begin;i<end;i++) {
+			UInt segment = active_segments[i];
+			UInt cell = segments[segment].cell;
+			if(active_cells.empty() || active_cells.back() != cell) {
+				active_cells.push_back(cell);
+				winner_cells.push_back(cell);
+			}
+			if(learn == false || segments[segment].alive == false)
+				continue;
+			adaptSegment(segment, permanence_increment, permanence_decrement);
+			int num_grow = (int)max_new_synapse_count - (int)num_active_potential[segment];
+			if(num_grow > 0 && segments[segment].alive)
+				growSynapses(segment, num_grow);
+		}
+	}
+
+	void burstColumn(UInt col, size_t begin, size_t end, bool learn)
+	{
+		UInt first_cell = col*col_in_tp;
+		for(UInt c=first_cell;c<first_cell+col_in_tp;c++)
+			active_cells.push_back(c);
+
+		UInt best = std::numeric_limits<UInt>::max();
+		for(size_t i=begin;i<end;i++) {
+			UInt segment = matching_segments[i];
+			if(best == std::numeric_limits<UInt>::max() || num_active_potential[segment] > num_active_potential[best])
+				best = segment;
+		}
+
+		if(best != std::numeric_limits<UInt>::max()) {
+			winner_cells.push_back(segments[best].cell);
+			if(learn && segments[best].alive) {
+				adaptSegment(best, permanence_increment, permanence_decrement);
+				int num_grow = (int)max_new_synapse_count - (int)num_active_potential[best];
+				if(num_grow > 0 && segments[best].alive)
+					growSynapses(best, num_grow);
+			}
+			return;
+		}
+
+		UInt winner = leastUsedCell(first_cell);
+		winner_cells.push_back(winner);
+		if(learn == false)
+			return;
+		size_t num_grow = std::min<size_t>(max_new_synapse_count, prev_winner_cells.size());
+		if(num_grow > 0)
+			growSynapses(createSegment(winner), num_grow);
+	}
+
+	void punishSegment(UInt segment, bool learn)
+	{
+		if(learn && predicted_segment_decrement > 0 && segments[segment].alive)
+			adaptSegment(segment, -predicted_segment_decrement, 0);
+	}
+
+	UInt leastUsedCell(UInt first_cell)
+	{
+		size_t fewest = std::numeric_limits<size_t>::max();
+		size_t num_tied = 0;
+		for(UInt c=first_cell;c<first_cell+col_in_tp;c++) {
+			size_t n = cell_segments[c].size();
+			if(n < fewest)
+				fewest = n, num_tied = 1;
+			else if(n == fewest)
+				num_tied++;
+		}
+		size_t pick = std::uniform_int_distribution<size_t>(0, num_tied-1)(rng);
+		for(UInt c=first_cell;c<first_cell+col_in_tp;c++) {
+			if(cell_segments[c].size() == fewest && pick-- == 0)
+				return c;
+		}
+		return first_cell;
+	}
+
+	void activateDendrites(bool learn)
+	{
+		active_bits.clear();
+		for(auto c : active_cells)
+			active_bits.set(c);
+
+		num_active_connected.resize(segments.size());
+		num_active_potential.resize(segments.size());
+		active_segments.clear();
+		matching_segments.clear();
+		//Segments are visited in pool order. During a compaction pass the compacted blocks come first
+		auto scan = [this](const std::vector<std::pair<UInt, UInt>>& blocks, size_t begin) {
+			for(size_t b=begin;b<blocks.size();b++) {
+				auto [offset, s] = blocks[b];
+				if(ownsBlock(s, offset) == false)
+					continue;
+				const SegmentData& seg = segments[s];
+				const Index* pre = presynaptic.data()+offset;
+				const uint8_t* perm = permanences.data()+offset;
+				UInt connected = 0;
+				UInt potential = 0;
+				for(size_t i=0;i<seg.size;i++) {
+					bool active = active_bits.test(pre[i]);
+					potential += active;
+					connected += active & (perm[i] >= connected_permanence);
+				}
+				num_active_connected[s] = connected;
+				num_active_potential[s] = potential;
+				if(connected >= activation_threshold)
+					active_segments.push_back(s);
+				if(potential >= min_threshold)
+					matching_segments.push_back(s);
+			}
+		};
+		bool pool_pass = compaction.running && compaction.pool_done == false;
+		if(pool_pass)
+			scan(compaction.blocks, 0);
+		scan(pool_blocks, pool_pass ? compaction.next : 0);
+		auto by_cell = [this](UInt a, UInt b) {
+			return segments[a].cell < segments[b].cell
+				|| (segments[a].cell == segments[b].cell && segments[a].ordinal < segments[b].ordinal);
+		};
+		std::sort(active_segments.begin(), active_segments.end(), by_cell);
+		std::sort(matching_segments.begin(), matching_segments.end(), by_cell);
+
+		predictive_cells.clear();
+		for(auto s : active_segments) {
+			if(predictive_cells.empty() || predictive_cells.back() != segments[s].cell)
+				predictive_cells.push_back(segments[s].cell);
+		}
+
+		if(learn) {
+			for(auto s : active_segments)
+				segments[s].last_used = iteration;
+			iteration++;
+		}
+	}
+
+	//Rounds a permanence change to 1/255 steps
+	int quantize(float delta)
+	{
+		float v = std::abs(delta)*255.f;
+		int q = (int)v;
+		float frac = v-q;
+		if(stochastic_rounding)
+			q += uniform() < frac;
+		else
+			q += frac >= 0.5f;
+		return delta < 0 ? -q : q;
+	}
+
+	float uniform()
+	{
+		round_state ^= round_state << 13;
+		round_state ^= round_state >> 7;
+		round_state ^= round_state << 17;
+		return (round_state >> 40)*(1.f/16777216.f);
+	}
+
+	void adaptSegment(UInt segment, float increment, float decrement)
+	{
+		SegmentData& seg = segments[segment];
+		Index* pre = presynaptic.data()+seg.offset;
+		uint8_t* perm = permanences.data()+seg.offset;
+		for(size_t i=0;i<seg.size;) {
+			int p = perm[i] + (wasActive(pre[i]) ? quantize(increment) : -quantize(decrement));
+			if(p <= 0) {
+				removeSynapse(seg, i);
+				continue;
+			}
+			perm[i] = std::min(p, 255);
+			i++;
+		}
+		if(seg.size == 0)
+			destroySegment(segment);
+	}
+
+	void removeSynapse(SegmentData& seg, size_t i)
+	{
+		seg.size--;
+		presynaptic[seg.offset+i] = presynaptic[seg.offset+seg.size];
+		permanences[seg.offset+i] = permanences[seg.offset+seg.size];
+		num_synapses--;
+	}
+
+	void growSynapses(UInt segment, size_t num_desired)
+	{
+		grow_candidates.assign(prev_winner_cells.begin(), prev_winner_cells.end());
+		{
+			const SegmentData& seg = segments[segment];
+			for(size_t i=0;i<seg.size;i++) {
+				auto it = std::lower_bound(grow_candidates.begin(), grow_candidates.end(), (UInt)presynaptic[seg.offset+i]);
+				if(it != grow_candidates.end() && *it == presynaptic[seg.offset+i])
+					grow_candidates.erase(it);
+			}
+		}
+		size_t num_actual = std::min(num_desired, grow_candidates.size());
+		if(num_actual == 0)
+			return;
+
+		size_t overrun = segments[segment].size + num_actual;
+		if(overrun > max_synapses_per_segment)
+			destroyMinPermanenceSynapses(segment, overrun-max_synapses_per_segment);
+		num_actual = std::min(num_actual, max_synapses_per_segment-segments[segment].size);
+		reserve(segment, segments[segment].size+num_actual);
+
+		SegmentData& seg = segments[segment];
+		for(size_t i=0;i<num_actual;i++) {
+			size_t j = std::uniform_int_distribution<size_t>(0, grow_candidates.size()-1)(rng);
+			presynaptic[seg.offset+seg.size] = grow_candidates[j];
+			permanences[seg.offset+seg.size] = initial_permanence;
+			seg.size++;
+			num_synapses++;
+			grow_candidates.erase(grow_candidates.begin()+j);
+		}
+	}
+
+	//Destroys the weakest synapses that do not come from a previous winner cell
+	void destroyMinPermanenceSynapses(UInt segment, size_t num_destroy)
+	{
+		SegmentData& seg = segments[segment];
+		for(size_t n=0;n<num_destroy;n++) {
+			size_t weakest = seg.size;
+			for(size_t i=0;i<seg.size;i++) {
+				if(wasWinner(presynaptic[seg.offset+i]))
+					continue;
+				if(weakest == seg.size || permanences[seg.offset+i] < permanences[seg.offset+weakest])
+					weakest = i;
+			}
+			if(weakest == seg.size)
+				return;
+			removeSynapse(seg, weakest);
+		}
+	}
+
+	//Makes sure the segment's block holds at least n synapses. Growing moves the block to the end
+	//of the pool and leaves a hole behind
+	void reserve(UInt segment, size_t n)
+	{
+		SegmentData& seg = segments[segment];
+		if(n <= seg.capacity)
+			return;
+		size_t capacity = std::min(std::max<size_t>(n, seg.capacity*2), max_synapses_per_segment);
+		size_t offset = presynaptic.size();
+		presynaptic.resize(offset+capacity);
+		permanences.resize(offset+capacity);
+		if(seg.size != 0) {
+			std::copy(presynaptic.begin()+seg.offset, presynaptic.begin()+seg.offset+seg.size, presynaptic.begin()+offset);
+			std::copy(permanences.begin()+seg.offset, permanences.begin()+seg.offset+seg.size, permanences.begin()+offset);
+		}
+		live_slots += capacity-seg.capacity;
+		seg.offset = offset;
+		seg.capacity = capacity;
+		pool_blocks.emplace_back(offset, segment);
+	}
+
+	//Whether the pool_blocks entry (offset, segment) is still current
+	bool ownsBlock(UInt segment, UInt offset) const
+	{
+		return segment < segments.size() && segments[segment].alive && segments[segment].offset == offset
+			&& segments[segment].capacity != 0;
+	}
+
+	UInt createSegment(UInt cell)
+	{
+		auto& segs = cell_segments[cell];
+		while(segs.size() >= max_segments_per_cell && segs.empty() == false) {
+			UInt lru = *std::min_element(segs.begin(), segs.end(), [this](UInt a, UInt b) {
+				return segments[a].last_used < segments[b].last_used;
+			});
+			destroySegment(lru);
+		}
+
+		UInt id;
+		if(free_segments.empty() == false) {
+			id = free_segments.back();
+			free_segments.pop_back();
+		}
+		else {
+			id = segments.size();
+			segments.push_back(SegmentData());
+		}
+		SegmentData& seg = segments[id];
+		seg = SegmentData();
+		seg.cell = cell;
+		seg.last_used = iteration;
+		seg.ordinal = next_ordinal++;
+		seg.alive = true;
+		segs.push_back(id);
+		return id;
+	}
+
+	void destroySegment(UInt segment)
+	{
+		SegmentData& seg = segments[segment];
+		auto& segs = cell_segments[seg.cell];
+		segs.erase(std::find(segs.begin(), segs.end(), segment));
+		num_synapses -= seg.size;
+		live_slots -= seg.capacity;
+		seg = SegmentData();
+		free_segments.push_back(segment);
+	}
+
+	void compactSegment(UInt offset, UInt segment)
+	{
+		if(ownsBlock(segment, offset) == false)
+			return;
+		//Every live block below offset is already compacted, so the block can slide down to write
+		SegmentData& seg = segments[segment];
+		size_t write = compaction.write;
+		size_t size = 0;
+		for(size_t i=0;i<seg.size;i++) {
+			if(permanences[offset+i] == 0)
+				continue;
+			presynaptic[write+size] = presynaptic[offset+i];
+			permanences[write+size] = permanences[offset+i];
+			size++;
+		}
+		num_synapses -= seg.size-size;
+		seg.size = size;
+		//An emptied segment gives up its block without leaving a hole below write
+		if(size == 0) {
+			destroySegment(segment);
+			return;
+		}
+		seg.offset = write;
+		compaction.blocks.emplace_back(write, segment);
+		compaction.write += seg.capacity;
+	}
+
+	//Ends the pool phase of a pass. The pool is cut at write and the freed tail given back
+	void finishPool()
+	{
+		presynaptic.resize(compaction.write);
+		permanences.resize(compaction.write);
+		presynaptic.releaseTail(compaction.write/8);
+		permanences.releaseTail(compaction.write/8);
+		std::swap(pool_blocks, compaction.blocks);
+		std::vector<std::pair<UInt, UInt>>().swap(compaction.blocks);
+		compaction.pool_done = true;
+		//Ids freed during the table phase are left to the next pass, so the phase ends
+		compaction.moves_left = free_segments.size();
+	}
+
+	//One step of the table phase. Drops the dead entries at the end of the segment table and moves
+	//the last live segment into a free id. Returns false when there is nothing left to move
+	bool moveLastSegment()
+	{
+		while(segments.empty() == false && segments.back().alive == false)
+			segments.pop_back();
+		while(free_segments.empty() == false && free_segments.back() >= segments.size())
+			free_segments.pop_back();
+		if(compaction.moves_left == 0 || free_segments.empty())
+			return false;
+		compaction.moves_left--;
+		UInt to = free_segments.back();
+		free_segments.pop_back();
+		moveSegment(segments.size()-1, to);
+		segments.pop_back();
+		return true;
+	}
+
+	//Gives segment from the free id to
+	void moveSegment(UInt from, UInt to)
+	{
+		const SegmentData& seg = segments[from];
+		auto relabel = [from, to](std::vector<UInt>& ids) {
+			auto it = std::find(ids.begin(), ids.end(), from);
+			if(it != ids.end())
+				*it = to;
+		};
+		relabel(cell_segments[seg.cell]);
+		//The segment lists and counts of the last step are read by the next one
+		relabel(active_segments);
+		relabel(matching_segments);
+		if(from < num_active_connected.size()) {
+			num_active_connected[to] = num_active_connected[from];
+			num_active_potential[to] = num_active_potential[from];
+		}
+		//Outside a pool pass, pool_blocks has one entry per offset, sorted by offset
+		if(seg.capacity != 0) {
+			auto block = std::lower_bound(pool_blocks.begin(), pool_blocks.end(), std::make_pair(seg.offset, UInt(0)));
+			if(block != pool_blocks.end() && block->first == seg.offset)
+				block->second = to;
+		}
+		segments[to] = seg;
+		segments[from] = SegmentData();
+	}
+
+	//Free ids beyond the end of the table are gone for good
+	void dropFreedIds()
+	{
+		free_segments.erase(std::remove_if(free_segments.begin(), free_segments.end()
+			, [this](UInt s){return s >= segments.size();}), free_segments.end());
+	}
+
+	//State of an incremental compaction pass. In the pool phase, pool_blocks[0, next) have been visited
+	//and the live ones among them now sit below write, listed in blocks. The table phase then moves at
+	//most moves_left segments
+	struct CompactionState
+	{
+		bool running = false;
+		bool pool_done = false;
+		size_t next = 0;
+		size_t write = 0;
+		size_t moves_left = 0;
+		std::vector<std::pair<UInt, UInt>> blocks;
+	};
+
+	size_t num_columns = 0;
+	size_t num_cells = 0;
+	size_t max_segments_per_cell = 255;
+	size_t max_synapses_per_segment = 255;
+
+	UInt activation_threshold = 13;
+	UInt min_threshold = 10;
+	UInt max_new_synapse_count = 20;
+	uint8_t initial_permanence = 54;
+	uint8_t connected_permanence = 128;
+	float permanence_increment = 0.1;
+	float permanence_decrement = 0.1;
+	float predicted_segment_decrement = 0;
+	bool stochastic_rounding = true;
+
+	//Synapse pool. Segment s owns [segments[s].offset, segments[s].offset+segments[s].capacity)
+	PoolArray<Index> presynaptic;
+	PoolArray<uint8_t> permanences;
+	PoolArray<SegmentData> segments;
+	std::vector<UInt> free_segments;
+	std::vector<std::vector<UInt>> cell_segments;
+	size_t num_synapses = 0;
+	size_t live_slots = 0;
+	UInt iteration = 0;
+	UInt next_ordinal = 0;
+
+	//Every block ever allocated as (offset, segment), in pool order. Entries are stale once the
+	//segment is destroyed or its block moves, and are dropped by the next compaction
+	std::vector<std::pair<UInt, UInt>> pool_blocks;
+	CompactionState compaction;
+	std::chrono::microseconds compaction_budget{0};
+
+	std::vector<UInt> active_cells;
+	std::vector<UInt> winner_cells;
+	std::vector<UInt> prev_winner_cells;
+	std::vector<UInt> predictive_cells;
+	//Sorted by cell
+	std::vector<UInt> active_segments;
+	std::vector<UInt> matching_segments;
+	std::vector<UInt> num_active_connected;
+	std::vector<UInt> num_active_potential;
+	PackedSDR active_bits;
+	std::vector<UInt> grow_candidates;
+
+	std::mt19937 rng;
+	uint64_t round_state = 0x9E3779B97F4A7C15ull;
+};
+
+//Encoders
+
+//Your standard ScalarEncoder.
+struct ScalarEncoder
+{
+	ScalarEncoder() = default;
+	ScalarEncoder(float minval, float maxval, size_t encode_len, size_t width)
+		: min_val(minval), max_val(maxval), encode_length(encode_len), sdr_length(width)
+	{
+		if(min_val > max_val)
+			throw std::runtime_error("ScalarEncoder error: min_val > max_val");
+	}
+
+	xt::xarray<bool> operator() (float value) const
+	{
+		return encode(value);
+	}
+
+	xt::xarray<bool> encode(float value) const
 	{
-		float encode_space = sdr_length - encode_length;
-		float v = value - min_val;
-		v /= max_val-min_val;
-		v = std::max(std::min(v, 1.f), 0.f);
-		int start = encode_space*v;
-		int end = start + encode_length;
 		xt::xarray<bool> res = xt::zeros<bool>({sdr_length});
-		xt::view(res, xt::range(start, end))  = true;
+		size_t start = encodeStart(value);
+		std::fill(res.data()+start, res.data()+start+encode_length, true);
 		return res;
 	}
 
+	//Writes the encoding into sdrLength() bools starting at out
+	void encode(float value, bool* out) const
+	{
+		size_t start = encodeStart(value);
+		std::fill(out, out+sdr_length, false);
+		std::fill(out+start, out+start+encode_length, true);
+	}
+
+	//Index of the first on bit. The on bits are [start, start+encodeLength())
+	size_t encodeStart(float value) const
+	{
+		float encode_space = sdr_length - encode_length;
+		float v = value - min_val;
+		v /= max_val-min_val;
+		v = std::max(std::min(v, 1.f), 0.f);
+		return (int)(encode_space*v);
+	}
+
 	void setMiniumValue(float val) {min_val = val;}
 	void setMaximumValue(float val) {max_val = val;}
 	void setEncodeLengt(size_t val) {encode_length = val;}
@@ -325,34 +2344,182 @@ struct CategoryEncoder
 
 	xt::xarray<bool> encode(size_t category) const
 	{
-		if(category > num_category)
-			throw std::runtime_error("CategoryEncoder: category > num_category");
-		xt::xarray<bool> res = xt::zeros<bool>({num_category, encode_length});
-		xt::view(res, category) = true;
-		return xt::flatten(res);
+		xt::xarray<bool> res = xt::zeros<bool>({sdrLength()});
+		auto range = encodeRange(category);
+		std::fill(res.data()+range.first, res.data()+range.second, true);
+		return res;
+	}
+
+	//Writes the encoding into sdrLength() bools starting at out
+	void encode(size_t category, bool* out) const
+	{
+		auto range = encodeRange(category);
+		std::fill(out, out+sdrLength(), false);
+		std::fill(out+range.first, out+range.second, true);
 	}
 
-	std::vector<size_t> decode(const xt::xarray<bool>& t)
+	//Sets the active bits in a FixedSDR or PackedSDR, starting at bit offset
+	template <typename SDRType>
+	void encode(size_t category, SDRType& out, size_t offset = 0) const
+	{
+		auto range = encodeRange(category);
+		for(size_t i=range.first;i<range.second;i++)
+			out.set(offset+i);
+	}
+
+	//The active bits of a category are [first, second)
+	std::pair<size_t, size_t> encodeRange(size_t category) const
+	{
+		if(category >= num_category)
+			throw std::runtime_error("CategoryEncoder: category >= num_category");
+		return {category*encode_length, (category+1)*encode_length};
+	}
+
+	std::vector<size_t> decode(const xt::xarray<bool>& t) const
+	{
+		assert(t.size() == sdrLength());
+		std::vector<size_t> possible_category;
+		const bool* ptr = t.data();
+		for(size_t i=0;i<num_category;i++) {
+			if(std::any_of(ptr+i*encode_length, ptr+(i+1)*encode_length, [](bool v){return v;}))
+				possible_category.push_back(i);
+		}
+		return possible_category;
+	}
+
+	//Same as above, counting each category's block with popcount
+	std::vector<size_t> decode(const PackedSDR& t) const
+	{
+		assert(t.size() == sdrLength());
+		std::vector<size_t> possible_category;
+		for(size_t i=0;i<num_category;i++) {
+			if(t.count(i*encode_length, (i+1)*encode_length) > 0)
+				possible_category.push_back(i);
+		}
+		return possible_category;
+	}
+
+	void setNumCategorise(size_t num_cat) {num_category = num_cat;}
+	void setEncodeLengt(size_t val) {encode_length = val;}
+
+	size_t numCategories() const {return num_category;}
+	size_t encodeLength() const {return encode_length;} 
+	size_t sdrLength() const {return num_category*encode_length;}
+protected:
+	size_t num_category;
+	size_t encode_length;
+};
+
+//Random distributed scalar encoder. Values are split into buckets of the given resolution and
+//bucket b activates the bits hash(b), hash(b+1) ... hash(b+encode_len-1). A bit that is already
+//taken by the bucket moves on to the next free bit, so exactly encode_len bits are set. Neighbouring
+//buckets share all but one bit, except where such a collision is resolved differently. Encoding
+//costs O(encode_len^2) at worst no matter how wide the SDR is. Buckets must stay below 2^53 in
+//magnitude, where doubles still tell them apart, so |value| is limited to resolution*2^53.
+struct RandomDistributedScalarEncoder
+{
+	RandomDistributedScalarEncoder() = default;
+	RandomDistributedScalarEncoder(float resolution, size_t encode_len, size_t width, uint64_t seed = 42)
+		: bucket_resolution(resolution), encode_length(encode_len), sdr_length(width), hash_seed(seed)
+	{
+		if(resolution <= 0)
+			throw std::runtime_error("RandomDistributedScalarEncoder error: resolution <= 0");
+		if(encode_len > width)
+			throw std::runtime_error("RandomDistributedScalarEncoder error: encode_len > width");
+	}
+
+	xt::xarray<bool> operator() (float value) const
+	{
+		return encode(value);
+	}
+
+	xt::xarray<bool> encode(float value) const
+	{
+		xt::xarray<bool> res = xt::zeros<bool>({sdr_length});
+		forEachBit(value, [&](size_t i){res[i] = true;});
+		return res;
+	}
+
+	//Sets the active bits in a FixedSDR or PackedSDR, starting at bit offset
+	template <typename SDRType>
+	void encode(float value, SDRType& out, size_t offset = 0) const
+	{
+		forEachBit(value, [&](size_t i){out.set(offset+i);});
+	}
+
+	//Writes the sorted indices of the active bits into out, reusing its storage
+	void encodeSparse(float value, std::vector<UInt>& out, size_t offset = 0) const
+	{
+		out.clear();
+		forEachBit(value, [&](size_t i){out.push_back(offset+i);});
+		std::sort(out.begin(), out.end());
+	}
+
+	std::vector<UInt> encodeSparse(float value) const
+	{
+		std::vector<UInt> res;
+		res.reserve(encode_length);
+		encodeSparse(value, res);
+		return res;
+	}
+
+	void setResolution(float val) {bucket_resolution = val;}
+	void setEncodeLengt(size_t val) {encode_length = val;}
+	void setSDRLength(size_t val) {sdr_length = val;}
+
+	float resolution() const {return bucket_resolution;}
+	size_t encodeLength() const {return encode_length;}
+	size_t sdrLength() const {return sdr_length;}
+	uint64_t seed() const {return hash_seed;}
+
+protected:
+	template <typename F>
+	void forEachBit(float value, F f) const
 	{
-		std::vector<size_t> possible_category;
-		for(size_t i=0;i<num_category;i++) {
-			if(xt::sum(xt::view(t, xt::range(i*encode_length, (i+1)*encode_length)))[0] > 0)
-				possible_category.push_back(i);
+		double b = std::floor((double)value/bucket_resolution);
+		if(std::isfinite(value) == false || std::abs(b) >= max_bucket)
+			throw std::runtime_error("RandomDistributedScalarEncoder: cannot encode " + std::to_string(value)
+				+ " with resolution " + std::to_string(bucket_resolution));
+		if(encode_length > sdr_length)
+			throw std::runtime_error("RandomDistributedScalarEncoder error: encode_len > width");
+		int64_t bucket = (int64_t)b;
+
+		//Bits already set for this bucket. Linear search, encode_length is small
+		std::array<size_t, 64> local;
+		std::vector<size_t> heap;
+		size_t* taken = local.data();
+		if(encode_length > local.size()) {
+			heap.resize(encode_length);
+			taken = heap.data();
+		}
+		for(size_t i=0;i<encode_length;i++) {
+			size_t bit = hash((uint64_t)(bucket+(int64_t)i)) % sdr_length;
+			while(std::find(taken, taken+i, bit) != taken+i)
+				bit = (bit+1) % sdr_length;
+			taken[i] = bit;
+			f(bit);
 		}
-		return possible_category;
 	}
 
-	void setNumCategorise(size_t num_cat) {num_category = num_cat;}
-	void setEncodeLengt(size_t val) {encode_length = val;}
+	//2^53
+	static constexpr double max_bucket = 9007199254740992.0;
 
-	size_t numCategories() const {return num_category;}
-	size_t encodeLength() const {return encode_length;} 
-	size_t sdrLength() const {return num_category*encode_length;}
-protected:
-	size_t num_category;
-	size_t encode_length;
-};
+	uint64_t hash(uint64_t x) const
+	{
+		x += hash_seed*0x9e3779b97f4a7c15ULL;
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
 
+	float bucket_resolution = 1;
+	size_t encode_length = 8;
+	size_t sdr_length = 32;
+	uint64_t hash_seed = 42;
+};
 
 //Handy encode functions
 inline xt::xarray<bool> encodeScalar(float value, float minval, float maxval, size_t encode_len, size_t width)
@@ -415,32 +2582,625 @@ public:
 		return buffer;
 	}
 
+	//Streaming execution over a sequence of samples. Every layer runs on its own thread
+	//and hands its results to the next layer through a bounded lock-free queue. So layer
+	//k works on sample t while layer k+1 works on sample t-1. Outputs are delivered in
+	//input order on the calling thread.
+	//source fills the next input and returns false when the stream ends.
+	//sink is called with the output of each sample.
+	void computeStream(std::function<bool(xt::xarray<bool>&)> source
+		, std::function<void(const xt::xarray<bool>&)> sink, bool learn, size_t queue_size = 4)
+	{
+		struct Item
+		{
+			xt::xarray<bool> sdr;
+			bool last = false;
+		};
+
+		if(layers.size() == 0)
+			throw std::runtime_error("SequentalNetwork: cannot stream through an empty network");
+
+		std::vector<std::unique_ptr<SPSCQueue<Item>>> queues;
+		for(size_t i=0;i<layers.size()+1;i++)
+			queues.push_back(std::make_unique<SPSCQueue<Item>>(queue_size));
+
+		//On an error every stage stops computing but keeps draining until the end marker,
+		//so no thread is left blocked on a full queue.
+		std::atomic<bool> failed{false};
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		auto setError = [&](std::exception_ptr e) {
+			std::lock_guard<std::mutex> lock(error_mutex);
+			if(error == nullptr)
+				error = e;
+			failed = true;
+		};
+
+		std::vector<std::thread> workers;
+		workers.emplace_back([&]() {
+			try {
+				while(failed == false) {
+					Item item;
+					if(source(item.sdr) == false)
+						break;
+					queues[0]->push(std::move(item));
+				}
+			}
+			catch(...) {
+				setError(std::current_exception());
+			}
+			Item end;
+			end.last = true;
+			queues[0]->push(std::move(end));
+		});
+
+		for(size_t i=0;i<layers.size();i++) {
+			workers.emplace_back([&, i]() {
+				HTMLayerBase* layer = layers[i].get();
+				SPSCQueue<Item>& in = *queues[i];
+				SPSCQueue<Item>& out = *queues[i+1];
+				while(true) {
+					Item item = in.pop();
+					if(item.last == true) {
+						out.push(std::move(item));
+						break;
+					}
+					if(failed == true)
+						continue;
+					try {
+						item.sdr = layer->compute(item.sdr, learn);
+						out.push(std::move(item));
+					}
+					catch(...) {
+						setError(std::current_exception());
+					}
+				}
+			});
+		}
+
+		SPSCQueue<Item>& results = *queues.back();
+		while(true) {
+			Item item = results.pop();
+			if(item.last == true)
+				break;
+			if(failed == true)
+				continue;
+			try {
+				sink(item.sdr);
+			}
+			catch(...) {
+				setError(std::current_exception());
+			}
+		}
+
+		for(auto& worker : workers)
+			worker.join();
+		if(error != nullptr)
+			std::rethrow_exception(error);
+	}
+
+	//Convenient wrapper of computeStream for samples that are already in memory
+	std::vector<xt::xarray<bool>> computeStream(const std::vector<xt::xarray<bool>>& inputs, bool learn, size_t queue_size = 4)
+	{
+		std::vector<xt::xarray<bool>> outputs;
+		outputs.reserve(inputs.size());
+		size_t index = 0;
+		computeStream([&](xt::xarray<bool>& t) {
+			if(index == inputs.size())
+				return false;
+			t = inputs[index++];
+			return true;
+		}, [&](const xt::xarray<bool>& t) {
+			outputs.push_back(t);
+		}, learn, queue_size);
+		return outputs;
+	}
+
 protected:
 	std::vector<std::unique_ptr<HTMLayerBase>> layers;
 };
 
+//Detects layers that can write their result into a caller provided buffer
+template <typename T, typename = void>
+struct has_compute_into : std::false_type {};
+
+template <typename T>
+struct has_compute_into<T, std::void_t<decltype(std::declval<T&>().compute(std::declval<const xt::xarray<bool>&>()
+	, true, std::declval<xt::xarray<bool>&>()))>> : std::true_type {};
+
+// Fixed topology counterpart of SequentalNetwork. i.e. StaticNetwork<SpatialPooler, TemporalMemory>
+// Layers are stored by value and the chain is unrolled at compile time, so there are no virtual calls
+// or dynamic_casts between layers. Results are passed between two ping-pong buffers owned by the network.
+template <typename ... Layers>
+class StaticNetwork final : public HTMLayerBase
+{
+	static_assert(sizeof...(Layers) > 0, "StaticNetwork: a network needs at least one layer");
+public:
+	static constexpr size_t num_layers = sizeof...(Layers);
+
+	StaticNetwork() = default;
+	StaticNetwork(Layers ... l)
+		: layers(std::move(l) ...)
+	{
+		input_shape = at<0>().input_shape;
+		output_shape = at<num_layers-1>().output_shape;
+	}
+
+	//Returns the layer. Type checked at compile time
+	template <size_t I>
+	auto& at()
+	{
+		return std::get<I>(layers);
+	}
+
+	template <size_t I>
+	const auto& at() const
+	{
+		return std::get<I>(layers);
+	}
+
+	//Reset layer state
+	virtual void reset() override
+	{
+		resetLayers(std::index_sequence_for<Layers ...>());
+	}
+
+	virtual xt::xarray<bool> compute(const xt::xarray<bool>& in, bool learn) override
+	{
+		return forward(in, learn);
+	}
+
+	//Same as compute() but returns a reference to the network's internal buffer instead of a copy.
+	//The reference is valid until the next call.
+	const xt::xarray<bool>& forward(const xt::xarray<bool>& in, bool learn)
+	{
+		return computeLayer<0>(in, learn);
+	}
+
+protected:
+	template <size_t I>
+	const xt::xarray<bool>& computeLayer(const xt::xarray<bool>& in, bool learn)
+	{
+		using LayerType = std::tuple_element_t<I, std::tuple<Layers ...>>;
+		LayerType& layer = std::get<I>(layers);
+		xt::xarray<bool>& out = buffers[I%2];
+		//Qualified calls so the compiler never goes through the vtable
+		if constexpr(has_compute_into<LayerType>::value)
+			layer.LayerType::compute(in, learn, out);
+		else
+			out = layer.LayerType::compute(in, learn);
+
+		if constexpr(I+1 == num_layers)
+			return out;
+		else
+			return computeLayer<I+1>(out, learn);
+	}
+
+	template <size_t ... I>
+	void resetLayers(std::index_sequence<I ...>)
+	{
+		(resetLayer<I>(), ...);
+	}
+
+	template <size_t I>
+	void resetLayer()
+	{
+		using LayerType = std::tuple_element_t<I, std::tuple<Layers ...>>;
+		std::get<I>(layers).LayerType::reset();
+	}
+
+	std::tuple<Layers ...> layers;
+	xt::xarray<bool> buffers[2];
+};
+
+//A network of named layers forming a directed acyclic graph. A node can read from several
+//nodes (their outputs are concatenated in the given order) and be read by several nodes.
+//Nodes can only read from nodes added before them, so insertion order is a valid topological
+//order. Nodes on the same topological level are computed in parallel on a thread pool.
+class GraphNetwork
+{
+public:
+	GraphNetwork(size_t num_threads = std::thread::hardware_concurrency())
+		: pool(num_threads)
+	{}
+
+	//Declares an external input of the network
+	void addInput(const std::string& name, std::vector<size_t> shape)
+	{
+		Node& node = addNode(name, {});
+		node.shape = shape;
+	}
+
+	//Adds a layer reading from the nodes listed in inputs. Returns the address of the layer
+	template <typename LayerType, typename ... Args>
+	LayerType* add(const std::string& name, const std::vector<std::string>& inputs, Args ... args)
+	{
+		if(inputs.size() == 0)
+			throw std::runtime_error("GraphNetwork: Node " + name + " has no inputs");
+		auto layer = std::make_unique<LayerType>(args ...);
+		LayerType* ptr = layer.get();
+
+		size_t input_size = 0;
+		for(const auto& input : inputs)
+			input_size += nodeSize(nodes[indexOf(input)]);
+		if(input_size != layer->inputSize())
+			throw std::runtime_error("GraphNetwork: Node " + name + " expects " + std::to_string(layer->inputSize())
+				+ " input bits, but its inputs provide " + std::to_string(input_size));
+
+		Node& node = addNode(name, inputs);
+		node.shape = layer->output_shape;
+		node.layer = std::move(layer);
+
+		//Nodes with more than one input own their input buffer, and every producer copies its
+		//output into its slice of it after computing (see scatter()). Layers take and return
+		//whole xt::xarray objects, so they cannot read from or write into views of a buffer
+		//shared by all nodes. One copy per edge avoids building xt::concatenate temporaries.
+		if(node.inputs.size() > 1) {
+			size_t id = nodes.size()-1;
+			node.concat_input = xt::zeros<bool>(node.layer->input_shape);
+			size_t offset = 0;
+			for(auto in : node.inputs) {
+				nodes[in].consumers.push_back({id, offset});
+				offset += nodeSize(nodes[in]);
+			}
+		}
+		return ptr;
+	}
+
+	void setInput(const std::string& name, const xt::xarray<bool>& t)
+	{
+		Node& node = nodes[indexOf(name)];
+		if(node.layer != nullptr)
+			throw std::runtime_error("GraphNetwork: " + name + " is not an input");
+		auto shape = t.shape();
+		if(std::equal(node.shape.begin(), node.shape.end(), shape.begin(), shape.end()) == false)
+			throw std::runtime_error("GraphNetwork: input " + name + " expects shape " + vectorToString(node.shape)
+				+ ", but get " + vectorToString(shape));
+		node.output = t;
+	}
+
+	void compute(const std::map<std::string, xt::xarray<bool>>& inputs, bool learn)
+	{
+		for(const auto& input : inputs)
+			setInput(input.first, input.second);
+		compute(learn);
+	}
+
+	//Runs the network on the inputs set by setInput()
+	void compute(bool learn)
+	{
+		for(auto id : levels.size() == 0 ? std::vector<size_t>() : levels[0]) {
+			if(nodes[id].output.size() != nodeSize(nodes[id]))
+				throw std::runtime_error("GraphNetwork: input " + nodes[id].name + " is not set");
+			scatter(nodes[id]);
+		}
+
+		std::vector<std::future<void>> futures;
+		for(size_t l=1;l<levels.size();l++) {
+			const auto& level = levels[l];
+			futures.clear();
+			for(size_t i=1;i<level.size();i++)
+				futures.push_back(pool.submit([this, id=level[i], learn](){computeNode(nodes[id], learn);}));
+			//The calling thread takes one node of the level itself
+			std::exception_ptr error;
+			try {
+				computeNode(nodes[level[0]], learn);
+			}
+			catch(...) {
+				error = std::current_exception();
+			}
+			for(auto& f : futures) {
+				try {
+					f.get();
+				}
+				catch(...) {
+					if(error == nullptr)
+						error = std::current_exception();
+				}
+			}
+			if(error != nullptr)
+				std::rethrow_exception(error);
+		}
+	}
+
+	//Output of a node from the last compute() call
+	const xt::xarray<bool>& output(const std::string& name) const
+	{
+		return nodes[indexOf(name)].output;
+	}
+
+	//Returns the address of the layer
+	template <typename T = HTMLayerBase>
+	T* at(const std::string& name)
+	{
+		HTMLayerBase* layer_ptr = nodes[indexOf(name)].layer.get();
+		if(layer_ptr == nullptr)
+			throw std::runtime_error("GraphNetwork: " + name + " is an input, not a layer");
+		T* ptr = dynamic_cast<T*>(layer_ptr);
+		if(ptr == nullptr)
+			throw std::runtime_error("GraphNetwork: Layer " + name + ", request type mismatch");
+		return ptr;
+	}
+
+	//Reset layer state
+	void reset()
+	{
+		for(auto& node : nodes) {
+			if(node.layer != nullptr)
+				node.layer->reset();
+		}
+	}
+
+	size_t numNodes() const
+	{
+		return nodes.size();
+	}
+
+protected:
+	struct Node
+	{
+		std::string name;
+		std::unique_ptr<HTMLayerBase> layer; //nullptr for inputs
+		std::vector<size_t> inputs;
+		std::vector<size_t> shape;
+		size_t level = 0;
+		xt::xarray<bool> output;
+		xt::xarray<bool> concat_input;
+		//(node, offset) of the nodes reading this node as one of several inputs
+		std::vector<std::pair<size_t, size_t>> consumers;
+	};
+
+	Node& addNode(const std::string& name, const std::vector<std::string>& inputs)
+	{
+		if(index.count(name) != 0)
+			throw std::runtime_error("GraphNetwork: Node " + name + " already exists");
+		Node node;
+		node.name = name;
+		for(const auto& input : inputs) {
+			size_t id = indexOf(input);
+			node.inputs.push_back(id);
+			node.level = std::max(node.level, nodes[id].level+1);
+		}
+		size_t id = nodes.size();
+		index[name] = id;
+		if(levels.size() <= node.level)
+			levels.resize(node.level+1);
+		levels[node.level].push_back(id);
+		nodes.push_back(std::move(node));
+		return nodes.back();
+	}
+
+	size_t indexOf(const std::string& name) const
+	{
+		auto it = index.find(name);
+		if(it == index.end())
+			throw std::runtime_error("GraphNetwork: No node named " + name);
+		return it->second;
+	}
+
+	static size_t nodeSize(const Node& node)
+	{
+		size_t s = 1;
+		for(auto v : node.shape)
+			s *= v;
+		return s;
+	}
+
+	void computeNode(Node& node, bool learn)
+	{
+		const xt::xarray<bool>& in = node.inputs.size() == 1 ? nodes[node.inputs[0]].output : node.concat_input;
+		node.output = node.layer->compute(in, learn);
+		scatter(node);
+	}
+
+	//Copies a node's output into the input buffers of its multi-input consumers. Each
+	//consumer has its own copy, so a node with several consumers is copied once per consumer
+	void scatter(const Node& node)
+	{
+		for(const auto& consumer : node.consumers)
+			std::copy(node.output.begin(), node.output.end(), nodes[consumer.first].concat_input.begin()+consumer.second);
+	}
+
+	std::vector<Node> nodes;
+	std::map<std::string, size_t> index;
+	std::vector<std::vector<size_t>> levels;
+	ThreadPool pool;
+};
+
+//Approximate nearest pattern search over packed SDRs using MinHash LSH. Every pattern gets
+//num_bands keys, each combining rows_per_band MinHash values of its on bits. Patterns sharing a
+//key with the query become candidates and are re-ranked by their exact overlap. A pattern with a
+//Jaccard similarity of s to the query is found with a probability of 1-(1-s^rows)^bands, so more
+//bands trade speed for recall and more rows per band trade recall for fewer candidates.
+class SDRIndex
+{
+public:
+	SDRIndex(size_t num_bits, size_t num_bands = 16, size_t rows_per_band = 2, uint64_t seed = 42)
+		: num_bits(num_bits), num_words(PackedSDR::numWords(num_bits))
+		, num_bands(num_bands), rows_per_band(rows_per_band), tables(num_bands)
+	{
+		if(num_bands == 0 || rows_per_band == 0)
+			throw std::runtime_error("SDRIndex: num_bands and rows_per_band must be > 0");
+		std::mt19937_64 rng(seed);
+		salts.resize(num_bands*rows_per_band);
+		for(auto& salt : salts)
+			salt = rng();
+	}
+
+	//Inserts the pattern of id, replacing the previous one if any
+	void insert(size_t id, const uint64_t* words)
+	{
+		if(id >= keys.size()) {
+			keys.resize(id+1);
+			patterns.resize((id+1)*num_words);
+		}
+		remove(id);
+		std::copy(words, words+num_words, patterns.begin()+id*num_words);
+		keys[id] = bandKeys(words);
+		for(size_t b=0;b<num_bands;b++)
+			tables[b][keys[id][b]].push_back(id);
+		num_items++;
+	}
+
+	void insert(size_t id, const PackedSDR& t)
+	{
+		if(t.size() != num_bits)
+			throw std::runtime_error("SDRIndex: expecting " + std::to_string(num_bits)
+				+ " bits, but get " + std::to_string(t.size()));
+		insert(id, t.data());
+	}
+
+	void remove(size_t id)
+	{
+		if(id >= keys.size() || keys[id].size() == 0)
+			return;
+		for(size_t b=0;b<num_bands;b++) {
+			auto it = tables[b].find(keys[id][b]);
+			auto& bucket = it->second;
+			*std::find(bucket.begin(), bucket.end(), id) = bucket.back();
+			bucket.pop_back();
+			if(bucket.size() == 0)
+				tables[b].erase(it);
+		}
+		keys[id].clear();
+		num_items--;
+	}
+
+	//Returns up to k (id, overlap) pairs of the candidates with the highest overlap, best first
+	std::vector<std::pair<size_t, size_t>> query(const PackedSDR& t, size_t k) const
+	{
+		if(t.size() != num_bits)
+			throw std::runtime_error("SDRIndex: expecting " + std::to_string(num_bits)
+				+ " bits, but get " + std::to_string(t.size()));
+		std::vector<size_t> candidates;
+		std::vector<uint64_t> query_keys = bandKeys(t.data());
+		for(size_t b=0;b<num_bands;b++) {
+			auto it = tables[b].find(query_keys[b]);
+			if(it != tables[b].end())
+				candidates.insert(candidates.end(), it->second.begin(), it->second.end());
+		}
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+		std::vector<std::pair<size_t, size_t>> res(candidates.size());
+		for(size_t i=0;i<candidates.size();i++)
+			res[i] = {candidates[i], overlap(t.data(), patterns.data()+candidates[i]*num_words, num_words)};
+		k = std::min(k, res.size());
+		std::partial_sort(res.begin(), res.begin()+k, res.end(), [](const auto& a, const auto& b) {
+			return a.second > b.second || (a.second == b.second && a.first < b.first);
+		});
+		res.resize(k);
+		return res;
+	}
+
+	size_t size() const {return num_items;}
+	size_t numBits() const {return num_bits;}
+	size_t numBands() const {return num_bands;}
+	size_t rowsPerBand() const {return rows_per_band;}
+
+protected:
+	static uint64_t mix(uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	std::vector<uint64_t> bandKeys(const uint64_t* words) const
+	{
+		std::vector<uint64_t> mins(salts.size(), std::numeric_limits<uint64_t>::max());
+		for(size_t i=0;i<num_words;i++) {
+			uint64_t w = words[i];
+			while(w != 0) {
+				uint64_t bit = i*64 + __builtin_ctzll(w);
+				w &= w-1;
+				for(size_t j=0;j<salts.size();j++)
+					mins[j] = std::min(mins[j], mix(bit ^ salts[j]));
+			}
+		}
+
+		std::vector<uint64_t> res(num_bands);
+		for(size_t b=0;b<num_bands;b++) {
+			uint64_t key = b;
+			for(size_t r=0;r<rows_per_band;r++)
+				key = mix(key ^ mins[b*rows_per_band+r]);
+			res[b] = key;
+		}
+		return res;
+	}
+
+	size_t num_bits;
+	size_t num_words;
+	size_t num_bands;
+	size_t rows_per_band;
+	size_t num_items = 0;
+	std::vector<uint64_t> salts;
+	std::vector<std::unordered_map<uint64_t, std::vector<size_t>>> tables;
+	//Band keys of every id. Empty for ids not in the index
+	std::vector<std::vector<uint64_t>> keys;
+	std::vector<uint64_t> patterns;
+};
+
 //Classifers
+//Each class keeps a bit count of the patterns added to it. A bit is part of the class's pattern
+//when it is on in at least bit_common_threhold of the added samples. The thresholded patterns for
+//the threshold given at construction are cached as packed bits, so a query is a single pass of
+//AND+popcount over them. Other thresholds fall back to the dense computation.
 struct SDRClassifer
 {
-	SDRClassifer(size_t num_classes, std::vector<size_t> shape)
+	SDRClassifer(size_t num_classes, std::vector<size_t> shape, float bit_common_threhold = 0.5)
 		: stored_patterns(num_classes, xt::zeros<int>(as<xt::xarray<int>::shape_type>(shape)))
 		, pattern_sotre_num(num_classes)
-	{}
+		, cache_threhold(bit_common_threhold)
+		, num_words(PackedSDR::numWords(stored_patterns.size() == 0 ? 0 : stored_patterns[0].size()))
+		, packed_patterns(num_classes*num_words)
+	{
+		assert(bit_common_threhold >= 0.f && bit_common_threhold <= 1.f);
+		for(size_t i=0;i<numPatterns();i++)
+			updateCache(i);
+	}
 
 	void add(size_t category, const xt::xarray<bool>& t)
 	{
+		checkInputSize(t);
+		int old_threhold = threholdCount(category, cache_threhold);
 		stored_patterns[category] += t;
 		pattern_sotre_num[category] += 1;
+		int new_threhold = threholdCount(category, cache_threhold);
+
+		//Counts only go up. Unless the threshold moved, the only bits that can flip are the
+		//ones in t, and they can only turn on
+		uint64_t* row = packed_patterns.data()+category*num_words;
+		if(new_threhold != old_threhold) {
+			updateCache(category);
+		}
+		else {
+			const int* counts = stored_patterns[category].data();
+			for(size_t i=0;i<t.size();i++) {
+				if(t[i] == true && counts[i] >= new_threhold)
+					row[i/64] |= (uint64_t)1 << (i%64);
+			}
+		}
+
+		if(index)
+			index->insert(category, row);
 	}
 
 	size_t compute(const xt::xarray<bool>& t, float bit_common_threhold = 0.5) const
 	{
 		assert(bit_common_threhold >= 0.f && bit_common_threhold <= 1.f);
+		checkInputSize(t);
+		if(bit_common_threhold != cache_threhold)
+			return computeDense(t, bit_common_threhold);
+
+		PackedSDR query(t);
 		size_t best_pattern = 0;
 		size_t best_score = 0;
 		for(size_t i=0;i<numPatterns();i++) {
-			auto overlap = t & xt::cast<bool>(stored_patterns[i] >= (int)(pattern_sotre_num[i]*bit_common_threhold));
-			size_t overlap_score = xt::sum(overlap)[0];
+			size_t overlap_score = overlap(query.data(), packed_patterns.data()+i*num_words, num_words);
 			if(overlap_score > best_score) {
 				best_score = overlap_score;
 				best_pattern = i;
@@ -450,22 +3210,160 @@ struct SDRClassifer
 		return best_pattern;
 	}
 
+	//Overlap scores of t against every class in one pass. The result can be passed to softmax()
+	xt::xarray<float> computeScores(const xt::xarray<bool>& t, float bit_common_threhold = 0.5) const
+	{
+		assert(bit_common_threhold >= 0.f && bit_common_threhold <= 1.f);
+		checkInputSize(t);
+		xt::xarray<float> scores = xt::zeros<float>({numPatterns()});
+		float* res = scores.data();
+		if(bit_common_threhold != cache_threhold) {
+			for(size_t i=0;i<numPatterns();i++)
+				res[i] = xt::sum(t & xt::cast<bool>(stored_patterns[i] >= threholdCount(i, bit_common_threhold)))[0];
+			return scores;
+		}
+
+		PackedSDR query(t);
+		auto score = [&](size_t begin, size_t end) {
+			for(size_t i=begin;i<end;i++)
+				res[i] = overlap(query.data(), packed_patterns.data()+i*num_words, num_words);
+		};
+		if(numPatterns() >= parallel_threhold)
+			parallelFor(0, numPatterns(), parallel_threhold/4, score);
+		else
+			score(0, numPatterns());
+		return scores;
+	}
+
+	//The k classes with the highest overlap, best first. Ties go to the lower class id as in compute()
+	std::vector<size_t> computeTopK(const xt::xarray<bool>& t, size_t k, float bit_common_threhold = 0.5) const
+	{
+		xt::xarray<float> scores = computeScores(t, bit_common_threhold);
+		std::vector<size_t> res(numPatterns());
+		std::iota(res.begin(), res.end(), 0);
+		k = std::min(k, res.size());
+		std::partial_sort(res.begin(), res.begin()+k, res.end(), [&](size_t a, size_t b) {
+			return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+		});
+		res.resize(k);
+		return res;
+	}
+
+	//Like compute() but only considers the candidates found by the LSH index. For large
+	//numbers of classes. Requires enableIndex(). Falls back to compute() if there are no candidates
+	size_t computeApprox(const xt::xarray<bool>& t) const
+	{
+		if(!index)
+			throw std::runtime_error("SDRClassifer: computeApprox() requires enableIndex()");
+		checkInputSize(t);
+		auto res = index->query(PackedSDR(t), 1);
+		if(res.size() == 0)
+			return compute(t, cache_threhold);
+		return res[0].first;
+	}
+
+	//Indexes the cached patterns for computeApprox(). Classes without samples are not indexed
+	void enableIndex(size_t num_bands = 16, size_t rows_per_band = 2)
+	{
+		index.emplace(stored_patterns.size() == 0 ? 0 : stored_patterns[0].size(), num_bands, rows_per_band);
+		for(size_t i=0;i<numPatterns();i++) {
+			if(pattern_sotre_num[i] != 0)
+				index->insert(i, packed_patterns.data()+i*num_words);
+		}
+	}
+
+	const SDRIndex* patternIndex() const
+	{
+		return index ? &*index : nullptr;
+	}
+
 	size_t numPatterns() const
 	{
 		return stored_patterns.size();
 	}
 
+	size_t numBits() const
+	{
+		return stored_patterns.size() == 0 ? 0 : stored_patterns[0].size();
+	}
+
 	void reset()
 	{
 		for(size_t i=0;i<numPatterns();i++) {
 			stored_patterns[i] = 0;
 			pattern_sotre_num[i] = 0;
+			updateCache(i);
+			if(index)
+				index->remove(i);
 		}
 	}
 
+	//Changes the threshold the packed patterns are cached for
+	void setCacheThrehold(float bit_common_threhold)
+	{
+		assert(bit_common_threhold >= 0.f && bit_common_threhold <= 1.f);
+		cache_threhold = bit_common_threhold;
+		for(size_t i=0;i<numPatterns();i++)
+			updateCache(i);
+		if(index)
+			enableIndex(index->numBands(), index->rowsPerBand());
+	}
+
+	float cacheThrehold() const {return cache_threhold;}
+
 protected:
+	//The packed paths read num_words words of the query, so a wrong size must not get through
+	void checkInputSize(const xt::xarray<bool>& t) const
+	{
+		if(t.size() != numBits())
+			throw std::runtime_error("SDRClassifer: expecting " + std::to_string(numBits())
+				+ " bits, but get " + std::to_string(t.size()));
+	}
+
+	size_t computeDense(const xt::xarray<bool>& t, float bit_common_threhold) const
+	{
+		size_t best_pattern = 0;
+		size_t best_score = 0;
+		for(size_t i=0;i<numPatterns();i++) {
+			auto overlap = t & xt::cast<bool>(stored_patterns[i] >= threholdCount(i, bit_common_threhold));
+			size_t overlap_score = xt::sum(overlap)[0];
+			if(overlap_score > best_score) {
+				best_score = overlap_score;
+				best_pattern = i;
+			}
+		}
+
+		return best_pattern;
+	}
+
+	int threholdCount(size_t category, float bit_common_threhold) const
+	{
+		return (int)(pattern_sotre_num[category]*bit_common_threhold);
+	}
+
+	//Rebuilds the packed pattern of a class from its bit counts
+	void updateCache(size_t category)
+	{
+		int threhold = threholdCount(category, cache_threhold);
+		const xt::xarray<int>& counts = stored_patterns[category];
+		uint64_t* row = packed_patterns.data()+category*num_words;
+		std::fill(row, row+num_words, 0);
+		for(size_t i=0;i<counts.size();i++) {
+			if(counts[i] >= threhold)
+				row[i/64] |= (uint64_t)1 << (i%64);
+		}
+	}
+
+	//Number of classes from which computeScores() splits the work across threads
+	static constexpr size_t parallel_threhold = 4096;
+
 	std::vector<xt::xarray<int>> stored_patterns;
 	std::vector<size_t> pattern_sotre_num;
+	float cache_threhold;
+	size_t num_words;
+	//Thresholded patterns of all classes, num_words words per class
+	std::vector<uint64_t> packed_patterns;
+	std::optional<SDRIndex> index;
 };
 
 } //End of namespace HTM
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <memory>
+#include <algorithm>
+#include <exception>
+#include <chrono>
+
+namespace HTM
+{
+
+//Waiting strategy of the blocking queue operations. Yields for a while, then sleeps with a growing
+//interval (capped at 1ms) so a thread waiting on an idle stage stops burning a core
+struct Backoff
+{
+	void wait()
+	{
+		if(n < 64)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min<size_t>(1000, (size_t)10 << std::min<size_t>(n-64, 7))));
+		n++;
+	}
+
+	size_t n = 0;
+};
+
+//A bounded, lock-free queue for exactly one producer thread and one consumer thread.
+//Used to hand buffers between pipeline stages running on different cores.
+template <typename T>
+class SPSCQueue
+{
+public:
+	SPSCQueue(size_t capacity = 2)
+		: buffer(capacity+1)
+	{}
+
+	SPSCQueue(const SPSCQueue&) = delete;
+	SPSCQueue& operator= (const SPSCQueue&) = delete;
+
+	//Returns false if the queue is full. value is only moved from on success
+	bool tryPush(T& value)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t next = increment(t);
+		if(next == head.load(std::memory_order_acquire))
+			return false;
+		buffer[t] = std::move(value);
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	//Returns false if the queue is empty
+	bool tryPop(T& value)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if(h == tail.load(std::memory_order_acquire))
+			return false;
+		value = std::move(buffer[h]);
+		head.store(increment(h), std::memory_order_release);
+		return true;
+	}
+
+	//Blocking versions. Wait with a Backoff until the operation succeeds
+	void push(T value)
+	{
+		Backoff backoff;
+		while(tryPush(value) == false)
+			backoff.wait();
+	}
+
+	T pop()
+	{
+		T value;
+		Backoff backoff;
+		while(tryPop(value) == false)
+			backoff.wait();
+		return value;
+	}
+
+	//Blocking versions that give up and return false once stop is set
+	bool push(T& value, const std::atomic<bool>& stop)
+	{
+		Backoff backoff;
+		while(tryPush(value) == false) {
+			if(stop.load(std::memory_order_relaxed))
+				return false;
+			backoff.wait();
+		}
+		return true;
+	}
+
+	bool pop(T& value, const std::atomic<bool>& stop)
+	{
+		Backoff backoff;
+		while(tryPop(value) == false) {
+			if(stop.load(std::memory_order_relaxed))
+				return false;
+			backoff.wait();
+		}
+		return true;
+	}
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	size_t capacity() const
+	{
+		return buffer.size()-1;
+	}
+
+protected:
+	size_t increment(size_t i) const
+	{
+		return i+1 == buffer.size() ? 0 : i+1;
+	}
+
+	std::vector<T> buffer;
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+};
+
+//A fixed set of worker threads consuming a shared task queue
+class ThreadPool
+{
+public:
+	ThreadPool(size_t num_threads = std::thread::hardware_concurrency())
+	{
+		num_threads = std::max<size_t>(num_threads, 1);
+		for(size_t i=0;i<num_threads;i++)
+			workers.emplace_back([this](){work();});
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv.notify_all();
+		for(auto& worker : workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator= (const ThreadPool&) = delete;
+
+	//Queues f for execution. Exceptions thrown by f are rethrown by the future's get()
+	template <typename F>
+	std::future<void> submit(F f)
+	{
+		auto task = std::make_shared<std::packaged_task<void()>>(std::move(f));
+		std::future<void> res = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.push([task](){(*task)();});
+		}
+		cv.notify_one();
+		return res;
+	}
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+protected:
+	void work()
+	{
+		while(true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv.wait(lock, [this](){return stop || tasks.empty() == false;});
+				if(stop && tasks.empty())
+					return;
+				task = std::move(tasks.front());
+				tasks.pop();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool stop = false;
+};
+
+//Process wide pool shared by the parallel algorithms
+inline ThreadPool& defaultThreadPool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+//Calls f(chunk_begin, chunk_end) over [begin, end) split into chunks of at least grain items.
+//The calling thread processes one chunk itself. Must not be nested inside another parallelFor
+//running on the same pool.
+template <typename F>
+void parallelFor(size_t begin, size_t end, size_t grain, F f, ThreadPool& pool = defaultThreadPool())
+{
+	if(begin >= end)
+		return;
+	size_t n = end-begin;
+	size_t num_chunks = std::min(pool.size()+1, (n+std::max<size_t>(grain, 1)-1)/std::max<size_t>(grain, 1));
+	if(num_chunks <= 1) {
+		f(begin, end);
+		return;
+	}
+	size_t chunk = (n+num_chunks-1)/num_chunks;
+	std::vector<std::future<void>> futures;
+	for(size_t start=begin+chunk;start<end;start+=chunk)
+		futures.push_back(pool.submit([&f, start, stop=std::min(start+chunk, end)](){f(start, stop);}));
+
+	std::exception_ptr error;
+	try {
+		f(begin, begin+chunk);
+	}
+	catch(...) {
+		error = std::current_exception();
+	}
+	for(auto& future : futures) {
+		try {
+			future.get();
+		}
+		catch(...) {
+			if(error == nullptr)
+				error = std::current_exception();
+		}
+	}
+	if(error != nullptr)
+		std::rethrow_exception(error);
+}
+
+} //End of namespace HTM
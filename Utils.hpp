@@ -5,6 +5,9 @@
 #include <xtensor/xview.hpp>
 #include <xtensor/xio.hpp>
 
+#include <complex>
+#include <vector>
+
 static xt::xarray<float> dct(const xt::xarray<float>& signal, const xt::xarray<float>& coeff)
 {
 	return xt::sum(coeff*signal, {1})/signal.shape()[0];
@@ -80,6 +83,19 @@ struct EarDFT
 	{
 		return computeSpectrum(signal, (double)t*rate, ftSize, weights, coeff);
 	}
+
+	//Allocation free version for streaming use. window points to the last ftSize
+	//samples and the dB level of each bin is written into out
+	void compute(const float* window, float* out) const
+	{
+		const float* c = coeff.data();
+		for(size_t i=0;i<bins.size();i++) {
+			float s = 0;
+			for(size_t j=0;j<ftSize;j++)
+				s += c[i*ftSize+j]*window[j];
+			out[i] = 20.f*std::log10(std::abs(s/ftSize)*weights[i]);
+		}
+	}
 	
 	xt::xarray<float> bins;
 	xt::xarray<float> coeff;
@@ -87,3 +103,79 @@ struct EarDFT
 	size_t ftSize;
 	size_t rate;
 };
+
+//Incremental version of EarDFT::compute for a window that advances by a fixed hop. It keeps the
+//complex sums A_i = sum_j e^(i*w_i*j)*window[j], whose real part is what EarDFT computes, and
+//moves them by a hop with
+//  A_i' = e^(-i*w_i*hop) * (A_i - sum_m e^(i*w_i*m)*outgoing[m] + sum_m e^(i*w_i*(N+m))*incoming[m])
+//That is O(bins*hop) per call instead of O(bins*window), so it only pays off when the hop is below
+//about a quarter of the window (worthwhile()). The sums are recomputed exactly every
+//resync_interval calls to bound the accumulated rounding error
+struct SlidingEarDFT
+{
+	SlidingEarDFT() = default;
+	SlidingEarDFT(const EarDFT& dft, size_t hopSize, size_t resyncInterval = 256)
+		: base(&dft), hop(hopSize), resync_interval(resyncInterval)
+		, sums(dft.bins.size()), rotation(dft.bins.size())
+		, outgoing_phase(dft.bins.size()*hopSize), incoming_phase(dft.bins.size()*hopSize)
+	{
+		if(hopSize == 0 || hopSize > dft.ftSize)
+			throw std::runtime_error("SlidingEarDFT: hop size must be in (0, window_size]");
+		for(size_t i=0;i<dft.bins.size();i++) {
+			double w = 2.0*M_PI*dft.bins[i]/dft.rate;
+			rotation[i] = std::polar(1.0, -w*hop);
+			for(size_t m=0;m<hop;m++) {
+				outgoing_phase[i*hop+m] = std::polar(1.0, w*m);
+				incoming_phase[i*hop+m] = std::polar(1.0, w*(dft.ftSize+m));
+			}
+		}
+	}
+
+	static bool worthwhile(size_t windowSize, size_t hopSize) {return hopSize*4 < windowSize;}
+
+	//Forgets the current window, equivalent to a window of zeros
+	void reset()
+	{
+		std::fill(sums.begin(), sums.end(), std::complex<double>(0));
+		since_resync = 0;
+	}
+
+	//window points to the ftSize samples after the advance, so its last hop samples are the
+	//incoming ones. outgoing points to the hop samples that just left the window
+	void compute(const float* window, const float* outgoing, float* out)
+	{
+		size_t n = base->ftSize;
+		const float* incoming = window+n-hop;
+		if(++since_resync >= resync_interval) {
+			since_resync = 0;
+			for(size_t i=0;i<sums.size();i++) {
+				double w = 2.0*M_PI*base->bins[i]/base->rate;
+				std::complex<double> s = 0;
+				for(size_t j=0;j<n;j++)
+					s += std::polar(1.0, w*j)*(double)window[j];
+				sums[i] = s;
+			}
+		}
+		else {
+			for(size_t i=0;i<sums.size();i++) {
+				const std::complex<double>* po = outgoing_phase.data()+i*hop;
+				const std::complex<double>* pi = incoming_phase.data()+i*hop;
+				std::complex<double> s = sums[i];
+				for(size_t m=0;m<hop;m++)
+					s += pi[m]*(double)incoming[m] - po[m]*(double)outgoing[m];
+				sums[i] = rotation[i]*s;
+			}
+		}
+		for(size_t i=0;i<sums.size();i++)
+			out[i] = 20.f*std::log10(std::abs((float)sums[i].real()/n)*base->weights[i]);
+	}
+
+	const EarDFT* base = nullptr;
+	size_t hop = 0;
+	size_t resync_interval = 0;
+	size_t since_resync = 0;
+	std::vector<std::complex<double>> sums;
+	std::vector<std::complex<double>> rotation;
+	std::vector<std::complex<double>> outgoing_phase;
+	std::vector<std::complex<double>> incoming_phase;
+};
@@ -3,17 +3,18 @@
 #include <random>
 #include <cmath>
 #include <functional>
+#include <chrono>
+#include <cstring>
 
 #include <xtensor/xio.hpp>
 #include "HTMHelper.hpp"
 #include "GridCell.hpp"
 
-template <typename T>
-float testAnomaly(HTM::TemporalMemory& tm, const T& encoder, std::function<glm::vec2(glm::vec2, float)> f)
+//Anomaly score of every step along the circle transformed by f
+template <typename TM, typename T>
+std::vector<float> testAnomaly(TM& tm, const T& encoder, std::function<glm::vec2(glm::vec2, float)> f)
 {
         float t = 0;
-        SDR sample_sdr = encoder.encode(glm::vec2(30,-1));
-        SDR last_pred = xt::zeros<bool>(sample_sdr.shape());
         std::vector<float> vec(2000);
         for(int i=0;i<2000;i++) {
                 t += 0.016;
@@ -23,22 +24,126 @@ float testAnomaly(HTM::TemporalMemory& tm, const T& encoder, std::function<glm::
 
                 glm::vec2 c = f({x, y}, t);
                 SDR input = encoder.encode(c);
-                SDR pred = tm.predict(input);
-
-                float score = HTM::anomaly(input, last_pred);
-                last_pred = pred;
-                vec[i] = score;
+                vec[i] = tm.computeWithAnomaly(input, false);
         }
 
+        return vec;
+}
+
+float mean(const std::vector<float>& vec)
+{
         return std::accumulate(vec.begin(), vec.end(), 0.f)/vec.size();
 }
 
-int main()
+//Compares speed and output of the float and the fixed point grid cell encoding
+void benchFixedPointGridCell()
 {
         GridCellEncoder2D encoder;
+        const int n = 100000;
+        std::vector<glm::vec2> positions(n);
+        for(auto& p : positions)
+                p = glm::vec2(random(-1000, 1000), random(-1000, 1000));
+
+        size_t checksum = 0;
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for(const auto& p : positions)
+                checksum += encoder.encode(p)[0];
+        auto t2 = std::chrono::high_resolution_clock::now();
+        for(const auto& p : positions)
+                checksum += encoder.encodeFixedPoint(p)[0];
+        auto t3 = std::chrono::high_resolution_clock::now();
+        for(const auto& p : positions) {
+                HTM::PackedSDR sdr(encoder.units.size()*16);
+                encoder.encodeFixedPoint(p, sdr);
+                checksum += sdr.words[0];
+        }
+        auto t4 = std::chrono::high_resolution_clock::now();
+
+        size_t sdr_disagree = 0;
+        size_t bit_disagree = 0;
+        for(const auto& p : positions) {
+                SDR a = encoder.encode(p);
+                SDR b = encoder.encodeFixedPoint(p);
+                size_t diff = 0;
+                for(size_t i=0;i<a.size();i++)
+                        diff += a[i] != b[i];
+                sdr_disagree += diff != 0;
+                bit_disagree += diff;
+        }
+
+        auto ms = [](auto a, auto b) {return std::chrono::duration<double, std::milli>(b-a).count();};
+        std::cout << "Float grid cell encode: " << ms(t1, t2) << "ms, fixed point: " << ms(t2, t3)
+                << "ms, fixed point into PackedSDR: " << ms(t3, t4) << "ms (" << n << " positions, checksum " << checksum << ")" << std::endl;
+        std::cout << "Fixed point disagreement: " << (float)sdr_disagree/n << " of SDRs, "
+                << (float)bit_disagree/(n*encoder.units.size()*16) << " of bits" << std::endl;
+}
+
+//Compares the native packed SpatialPooler against the nupic wrapper on random sparse inputs
+void benchSpatialPooler()
+{
+        const size_t num_inputs = 1024;
+        const size_t num_columns = 2048;
+        const int n = 2000;
+        std::vector<std::vector<UInt>> inputs(n);
+        for(auto& in : inputs) {
+                for(UInt i=0;i<num_inputs;i++) {
+                        if(random(0, 1) < 0.04)
+                                in.push_back(i);
+                }
+        }
+
+        HTM::SpatialPooler sp({num_inputs}, {num_columns});
+        HTM::PackedSpatialPooler packed_sp({num_inputs}, {num_columns});
+        auto run = [&](auto& layer) {
+                std::vector<UInt> active;
+                std::vector<size_t> usage(layer.outputSize());
+                size_t num_active = 0;
+                auto t1 = std::chrono::high_resolution_clock::now();
+                for(const auto& in : inputs) {
+                        layer.compute(in, true, active);
+                        num_active += active.size();
+                        for(auto c : active)
+                                usage[c]++;
+                }
+                auto t2 = std::chrono::high_resolution_clock::now();
+                size_t used = std::count_if(usage.begin(), usage.end(), [](size_t u){return u != 0;});
+                std::cout << std::chrono::duration<double, std::milli>(t2-t1).count() << "ms, "
+                        << (float)num_active/n << " active columns per step, " << used << " columns ever active" << std::endl;
+        };
+        std::cout << "nupic SpatialPooler: ";
+        run(sp);
+        std::cout << "PackedSpatialPooler: ";
+        run(packed_sp);
+
+        HTM::PackedSpatialPooler wide_sp({num_inputs}, {8192}, 16, 0.5, 40);
+        HTM::PackedSpatialPooler parallel_sp({num_inputs}, {8192}, 16, 0.5, 40);
+        parallel_sp.enableParallel();
+        std::cout << "PackedSpatialPooler, 8192 columns: ";
+        run(wide_sp);
+        std::cout << "PackedSpatialPooler, 8192 columns on " << HTM::defaultThreadPool().size()+1 << " threads: ";
+        run(parallel_sp);
+}
+
+static bool hasFlag(int argc, char** argv, const char* flag)
+{
+        for(int i=1;i<argc;i++) {
+                if(std::strcmp(argv[i], flag) == 0)
+                        return true;
+        }
+        return false;
+}
+
+//Optional benchmarks are enabled by passing their flag, e.g. `bench --grid-cell`
+int main(int argc, char** argv)
+{
+        GridCellEncoder2D encoder;
+        if(hasFlag(argc, argv, "--grid-cell"))
+                benchFixedPointGridCell();
+        if(hasFlag(argc, argv, "--sp"))
+                benchSpatialPooler();
 	SDR sample_sdr = encoder.encode(glm::vec2(30,-1));
 	HTM::TemporalMemory tm({sample_sdr.size()} , 32);
-	SDR last_pred = xt::zeros<bool>(sample_sdr.shape());
+	HTM::CompactTemporalMemory<uint16_t> compact_tm({sample_sdr.size()} , 32);
 
         tm->setPermanenceIncrement(0.04);
 	tm->setPermanenceDecrement(0.045);
@@ -46,6 +151,12 @@ int main()
 	tm->setCheckInputs(false);
 	tm->setMaxNewSynapseCount(24);
 
+        compact_tm.setPermanenceIncrement(tm->getPermanenceIncrement());
+        compact_tm.setPermanenceDecrement(tm->getPermanenceDecrement());
+        compact_tm.setPredictedSegmentDecrement(tm->getPredictedSegmentDecrement());
+        compact_tm.setMaxNewSynapseCount(24);
+        compact_tm.setCompactionBudget(std::chrono::microseconds(200));
+
         float t = 0;
 
         //Pre train the TM
@@ -56,34 +167,46 @@ int main()
 
                 SDR input = encoder.encode({x, y});
 		tm.train(input);
+                compact_tm.train(input);
         }
 
-        float score = 0;
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return c;});
-        std::cout << "Normal: " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(0, 5);});
-        std::cout << "Shift 5 px: " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(0, 50);});
-        std::cout << "Shift 50 px: " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(200, 200);});
-        std::cout << "Revolve at (200, 200): " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(cos(t*3.14)*105.f + 100, sin(t*3.14)*105.f + 100);});
-        std::cout << "Radius at 105: " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(cos(-t*3.14)*105.f + 100, sin(-t*3.14)*105.f + 100);});
-        std::cout << "Reverse rotation direction: " << score << std::endl;
-
-        tm.reset();
-        score = testAnomaly(tm, encoder, [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(50, 50);});
-        std::cout << "Fixed at (50, 50): " << score << std::endl;
-}
\ No newline at end of file
+        //nupic stores at least the synapse data plus its index in the segment and presynaptic lists
+        size_t nupic_bytes = sizeof(nupic::algorithms::connections::SynapseData) + 2*sizeof(nupic::algorithms::connections::Synapse);
+        std::cout << "nupic TM: " << tm->connections.numSynapses() << " synapses, at least " << nupic_bytes << " bytes per synapse" << std::endl;
+        std::cout << "Compact TM: " << compact_tm.numSynapses() << " synapses, " << sizeof(uint16_t)+1 << " bytes per synapse, "
+                << (float)compact_tm.memoryUsage()/compact_tm.numSynapses() << " bytes per synapse including segments, "
+                << compact_tm.poolHoles() << " unused pool slots" << std::endl;
+
+        //Every test below only runs inference
+        tm.setFrozenInference(true);
+
+        std::vector<std::pair<std::string, std::function<glm::vec2(glm::vec2, float)>>> tests = {
+                {"Normal", [](glm::vec2 c, float t)->glm::vec2{return c;}},
+                {"Shift 5 px", [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(0, 5);}},
+                {"Shift 50 px", [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(0, 50);}},
+                {"Revolve at (200, 200)", [](glm::vec2 c, float t)->glm::vec2{return c+glm::vec2(200, 200);}},
+                {"Radius at 105", [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(cos(t*3.14)*105.f + 100, sin(t*3.14)*105.f + 100);}},
+                {"Reverse rotation direction", [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(cos(-t*3.14)*105.f + 100, sin(-t*3.14)*105.f + 100);}},
+                {"Fixed at (50, 50)", [](glm::vec2 c, float t)->glm::vec2{return glm::vec2(50, 50);}}
+        };
+
+        //The compact TM sees the same inputs, so its score is compared step by step
+        float max_deviation = 0;
+        for(const auto& [name, f] : tests) {
+                tm.reset();
+                std::vector<float> scores = testAnomaly(tm, encoder, f);
+                compact_tm.reset();
+                std::vector<float> compact_scores = testAnomaly(compact_tm, encoder, f);
+                float deviation_sum = 0;
+                float step_max_deviation = 0;
+                for(size_t i=0;i<scores.size();i++) {
+                        float d = std::abs(scores[i]-compact_scores[i]);
+                        deviation_sum += d;
+                        step_max_deviation = std::max(step_max_deviation, d);
+                }
+                max_deviation = std::max(max_deviation, step_max_deviation);
+                std::cout << name << ": " << mean(scores) << " (compact TM: " << mean(compact_scores)
+                        << ", per step deviation: mean " << deviation_sum/scores.size() << ", max " << step_max_deviation << ")" << std::endl;
+        }
+        std::cout << "Max per step anomaly deviation of the compact TM: " << max_deviation << std::endl;
+}
@@ -85,7 +85,6 @@ int main()
 	GridCellEncoder2D encoder;
 	SDR sample_sdr = encoder.encode(glm::vec2(30,-1));
 	HTM::TemporalMemory tm({sample_sdr.size()} , 32);
-	SDR last_pred = xt::zeros<bool>(sample_sdr.shape());
 
 	CircularBuffer<float> anomaly_history(256);
 	for(size_t i=0;i<anomaly_history.capacity();i++)
@@ -96,6 +95,8 @@ int main()
 	tm->setPredictedSegmentDecrement(density(sample_sdr)*1.3f*tm->getPermanenceIncrement());
 	tm->setCheckInputs(false);
 	tm->setMaxNewSynapseCount(24);
+	//Reused every frame by computeWithAnomaly
+	SDR pred;
 	
 	float t = 0;
 	
@@ -205,10 +206,7 @@ int main()
 		circle.setPosition(x, y);
 
 		SDR input = encoder.encode({x, y});
-		SDR pred = tm.compute(input, learn);
-
-		float score = HTM::anomaly(input, last_pred);
-		last_pred = pred;
+		float score = tm.computeWithAnomaly(input, learn, pred);
 		static float anomaly_thr = 0.5;
 
 		anomaly_history.add(score);
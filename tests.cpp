@@ -0,0 +1,711 @@
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <string>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <future>
+
+#include "HTMHelper.hpp"
+#include "GridCell.hpp"
+
+//Plain checks, no framework. A failed CHECK prints where it failed and makes the run return 1
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if(!(cond)) { \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+			failures++; \
+		} \
+	} while(0)
+
+//Whether f throws a std::runtime_error
+template <typename F>
+bool throwsRuntimeError(F f)
+{
+	try {
+		f();
+	}
+	catch(std::runtime_error&) {
+		return true;
+	}
+	return false;
+}
+
+//Every module has to land in its own 16 bits of the encoder's SDR
+void testGridCellEncoderModules()
+{
+	GridCellEncoder2D encoder(8);
+	for(glm::vec2 pos : {glm::vec2(0, 0), glm::vec2(30, -1), glm::vec2(-517.25f, 912.5f)}) {
+		SDR sdr = encoder.encode(pos);
+		CHECK(sdr.size() == encoder.units.size()*16);
+		size_t start = 0;
+		for(const auto& u : encoder.units) {
+			SDR expected = u.encode(pos);
+			for(size_t i=0;i<expected.size();i++)
+				CHECK(sdr[start+i] == expected[i]);
+			start += expected.size();
+		}
+	}
+}
+
+//Exposes the lattice lookup of GridCellEncoderND
+struct LatticeProbe : public GridCellEncoderND<2>
+{
+	using GridCellEncoderND<2>::latticeCells;
+};
+
+//Coordinates just around the period boundary have to stay inside their own module
+void testGridCellLatticeWrap()
+{
+	const float eps = 1e-8f;
+	for(float x : {-eps, eps, 0.f, -4.f-eps, 4.f-eps, 4.f+eps}) {
+		for(float y : {-eps, eps, 0.f}) {
+			std::vector<size_t> cells;
+			LatticeProbe::latticeCells(x, y, 1, [&cells](size_t i){cells.push_back(i);});
+			CHECK(cells.size() == 2);
+			for(auto c : cells)
+				CHECK(c >= 16 && c < 32);
+		}
+	}
+}
+
+//A position just below a lattice boundary of the 2D encoders has to stay inside its own module
+void testGridCell2DLatticeWrap()
+{
+	FixedGridCellEncoder2D<2> encoder;
+	for(auto& u : encoder.units) {
+		u.transform_matrix = glm::mat2x2(1, 0, 0, 1);
+		u.scale = 1;
+		u.bias = glm::vec2(0, 0);
+	}
+	for(glm::vec2 pos : {glm::vec2(-1e-8f, -1e-8f), glm::vec2(-1e-8f, 1.f), glm::vec2(-4.f-1e-7f, -1e-8f)}) {
+		auto bits = encoder.encodeFixed(pos);
+		size_t in_range = 0;
+		for(size_t m=0;m<encoder.units.size();m++) {
+			size_t module_bits = 0;
+			for(size_t i=0;i<16;i++)
+				module_bits += bits.test(m*16+i);
+			CHECK(module_bits == 1 || module_bits == 2);
+			in_range += module_bits;
+		}
+		//Bits past the end of the SDR would still land in its last word
+		CHECK(bits.count() == in_range);
+	}
+}
+
+//The sparse and fixed encodings of LocEncoder2D have to set the runs its encoders describe
+void testLocEncoder2D()
+{
+	LocEncoder2D loc;
+	for(glm::vec2 pos : {glm::vec2(0, 0), glm::vec2(123.5f, 400.f), glm::vec2(800, 600), glm::vec2(-50, 1e4f)}) {
+		auto bits = loc.encodeSparse(pos);
+		auto fixed = loc.encodeFixed(pos);
+		CHECK(bits.size() == 2*loc.xEncoder().encodeLength());
+		CHECK(fixed.count() == bits.size());
+		for(auto i : bits)
+			CHECK(i < LocEncoder2D::sdr_size && fixed.test(i));
+		CHECK(bits.front() == loc.xEncoder().encodeStart(pos.x));
+		CHECK(bits[loc.yEncoder().encodeLength()] == loc.xEncoder().sdrLength() + loc.yEncoder().encodeStart(pos.y));
+	}
+}
+
+//Every bucket has to set exactly encode_len bits, like LocEncoder2D, and neighbouring buckets
+//have to stay similar
+void testRandomDistributedScalarEncoder()
+{
+	HTM::RandomDistributedScalarEncoder encoder(1.f, 26, 256);
+	std::vector<UInt> prev;
+	size_t overlap_sum = 0;
+	for(int v=-500;v<500;v++) {
+		auto bits = encoder.encodeSparse((float)v);
+		CHECK(bits.size() == 26);
+		CHECK(std::adjacent_find(bits.begin(), bits.end()) == bits.end());
+		if(prev.empty() == false) {
+			std::vector<UInt> common;
+			std::set_intersection(bits.begin(), bits.end(), prev.begin(), prev.end(), std::back_inserter(common));
+			overlap_sum += common.size();
+		}
+		prev = bits;
+	}
+	CHECK(overlap_sum > 999*24);
+
+	RDSELocEncoder2D loc;
+	for(glm::vec2 pos : {glm::vec2(0, 0), glm::vec2(123.5f, -40.f), glm::vec2(1e6f, 3e5f)})
+		CHECK(loc.encodeFixed(pos).count() == 52);
+
+	//Buckets beyond 2^53 are rejected instead of overflowing
+	CHECK(encoder.encodeSparse(1e15f).size() == 26);
+	CHECK(throwsRuntimeError([&](){encoder.encodeSparse(1e17f);}));
+	CHECK(throwsRuntimeError([&](){encoder.encodeSparse(std::numeric_limits<float>::quiet_NaN());}));
+	HTM::RandomDistributedScalarEncoder tight(1e-30f, 8, 32);
+	CHECK(throwsRuntimeError([&](){tight.encodeSparse(1.f);}));
+}
+
+//Exposes the reused input buffer of the nupic wrappers
+template <typename Layer>
+struct InputBufferProbe : public Layer
+{
+	using Layer::Layer;
+	using Layer::in_buffer;
+};
+
+//An out of range index must be rejected before the input buffer of a 64 input layer is modified
+template <typename Layer>
+void checkSparseBadIndex(Layer& layer)
+{
+	std::vector<UInt> active_columns;
+	layer.compute(std::vector<UInt>{1, 5, 9}, false, active_columns);
+	bool thrown = false;
+	try {
+		layer.compute(std::vector<UInt>{2, 3, 64}, false, active_columns);
+	}
+	catch(std::runtime_error&) {
+		thrown = true;
+	}
+	CHECK(thrown);
+	for(size_t i=0;i<layer.in_buffer.size();i++)
+		CHECK(layer.in_buffer[i] == (i == 1 || i == 5 || i == 9));
+
+	layer.compute(std::vector<UInt>{7}, false, active_columns);
+	for(size_t i=0;i<layer.in_buffer.size();i++)
+		CHECK(layer.in_buffer[i] == (i == 7));
+}
+
+void testSpatialPoolerSparseBadIndex()
+{
+	InputBufferProbe<HTM::SpatialPooler> sp({64}, {128});
+	checkSparseBadIndex(sp);
+}
+
+void testTemporalPoolerSparseBadIndex()
+{
+	InputBufferProbe<HTM::TemporalPooler> tp({64}, 4);
+	checkSparseBadIndex(tp);
+}
+
+//A zero permanence must still be able to climb past the trim threshold when the constructor
+//raises a column to stimulus_threshold connected synapses
+void testPackedSpatialPoolerStimulusThreshold()
+{
+	const size_t threshold = 12;
+	HTM::PackedSpatialPooler sp({64}, {32}, 16, 0.5, 4, threshold);
+	for(size_t c=0;c<sp.numColumns();c++)
+		CHECK(sp.connectedCount(c) >= threshold);
+
+	std::mt19937 rng(7);
+	std::vector<UInt> active_inputs, active_columns;
+	for(int i=0;i<50;i++) {
+		active_inputs.clear();
+		for(UInt j=0;j<64;j++) {
+			if(rng()%4 == 0)
+				active_inputs.push_back(j);
+		}
+		sp.compute(active_inputs, true, active_columns);
+		CHECK(active_columns.size() <= 4);
+		for(auto c : active_columns)
+			CHECK(sp.connectedCount(c) >= threshold);
+	}
+}
+
+//Blocked parallel compute has to pick and learn exactly the same columns as the serial one
+void testPackedSpatialPoolerParallel()
+{
+	HTM::ThreadPool pool(4);
+	HTM::PackedSpatialPooler serial({256}, {1024}, 16, 0.5, 20, 2);
+	HTM::PackedSpatialPooler parallel({256}, {1024}, 16, 0.5, 20, 2);
+	parallel.enableParallel(pool, 100);
+
+	std::mt19937 rng(11);
+	std::vector<UInt> active_inputs, serial_columns, parallel_columns;
+	for(int i=0;i<200;i++) {
+		active_inputs.clear();
+		for(UInt j=0;j<256;j++) {
+			if(rng()%10 == 0)
+				active_inputs.push_back(j);
+		}
+		serial.compute(active_inputs, true, serial_columns);
+		parallel.compute(active_inputs, true, parallel_columns);
+		CHECK(serial_columns == parallel_columns);
+	}
+	for(size_t c=0;c<serial.numColumns();c++)
+		CHECK(serial.connectedCount(c) == parallel.connectedCount(c));
+}
+
+//A repeating sequence of random sorted column sets
+static std::vector<std::vector<UInt>> makeSequence(size_t length, size_t num_columns, size_t num_active, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<UInt> columns(num_columns);
+	std::iota(columns.begin(), columns.end(), 0);
+	std::vector<std::vector<UInt>> sequence(length);
+	for(auto& s : sequence) {
+		std::shuffle(columns.begin(), columns.end(), rng);
+		s.assign(columns.begin(), columns.begin()+num_active);
+		std::sort(s.begin(), s.end());
+	}
+	return sequence;
+}
+
+//Inference on the compact frozen copy has to predict exactly what nupic's TemporalMemory predicts,
+//also after the connected permanence is changed through operator->
+void testFrozenInference()
+{
+	auto sequence = makeSequence(8, 256, 20, 3);
+	HTM::TemporalMemory frozen({256}, 8);
+	HTM::TemporalMemory reference({256}, 8);
+	for(int i=0;i<40;i++) {
+		for(const auto& s : sequence) {
+			frozen.computeWithAnomaly(s, true);
+			reference.computeWithAnomaly(s, true);
+		}
+	}
+	frozen.setFrozenInference(true);
+
+	std::vector<UInt> frozen_columns, reference_columns;
+	for(int round=0;round<2;round++) {
+		if(round == 1) {
+			frozen->setConnectedPermanence(0.3);
+			reference->setConnectedPermanence(0.3);
+		}
+		for(const auto& s : sequence) {
+			CHECK(frozen.computeWithAnomaly(s, false) == reference.computeWithAnomaly(s, false));
+			frozen.predictedColumns(frozen_columns);
+			reference.predictedColumns(reference_columns);
+			CHECK(frozen_columns == reference_columns);
+		}
+	}
+}
+
+//Learning resumed after inference-only steps has to continue the sequence exactly as if every step
+//had run through nupic's TemporalMemory
+void testFrozenResume()
+{
+	auto sequence = makeSequence(8, 256, 20, 5);
+	HTM::TemporalMemory frozen({256}, 8);
+	HTM::TemporalMemory reference({256}, 8);
+	for(int i=0;i<40;i++) {
+		for(const auto& s : sequence) {
+			frozen.computeWithAnomaly(s, true);
+			reference.computeWithAnomaly(s, true);
+		}
+	}
+	frozen.setFrozenInference(true);
+
+	std::vector<UInt> frozen_columns, reference_columns;
+	for(int i=0;i<4*(int)sequence.size();i++) {
+		const auto& s = sequence[i%sequence.size()];
+		bool learn = i >= 5;
+		CHECK(frozen.computeWithAnomaly(s, learn) == reference.computeWithAnomaly(s, learn));
+		frozen.predictedColumns(frozen_columns);
+		reference.predictedColumns(reference_columns);
+		CHECK(frozen_columns == reference_columns);
+	}
+}
+
+//The 8-bit compact TM runs the same algorithm as nupic's TemporalMemory, so on the same input its
+//anomaly scores have to stay close to nupic's step by step
+void testCompactTemporalMemory()
+{
+	auto sequence = makeSequence(8, 256, 20, 5);
+	HTM::TemporalMemory reference({256}, 8);
+	HTM::CompactTemporalMemory<uint16_t> compact({256}, 8);
+	float deviation_sum = 0;
+	float last_pass_anomaly = 0;
+	size_t num_steps = 0;
+	for(int pass=0;pass<40;pass++) {
+		for(const auto& s : sequence) {
+			float a = reference.computeWithAnomaly(s, true);
+			float b = compact.computeWithAnomaly(s, true);
+			deviation_sum += std::abs(a-b);
+			num_steps++;
+			if(pass == 39)
+				last_pass_anomaly += b/sequence.size();
+		}
+	}
+	//The two differ in their random choices and in permanence rounding, not in the algorithm
+	CHECK(deviation_sum/num_steps < 0.1f);
+	CHECK(last_pass_anomaly < 0.2f);
+}
+
+//Compaction must not change what the compact TM computes, only where its synapses are stored
+void testCompactTemporalMemoryCompaction()
+{
+	//Noisy repeats of two sequences, with few segments per cell, keep segments growing and being
+	//replaced, which leaves holes in the pool
+	auto first = makeSequence(32, 256, 20, 7);
+	auto second = makeSequence(32, 256, 20, 8);
+	std::mt19937 rng(9);
+	HTM::CompactTemporalMemory<uint16_t> plain({256}, 4, 4);
+	HTM::CompactTemporalMemory<uint16_t> compacting({256}, 4, 4);
+	compacting.setCompactionBudget(std::chrono::microseconds(20));
+	size_t mismatches = 0;
+	size_t passes = 0;
+	for(int pass=0;pass<30;pass++) {
+		for(auto s : pass%3 == 2 ? second : first) {
+			for(int i=0;i<4;i++)
+				s[rng()%s.size()] = rng()%256;
+			std::sort(s.begin(), s.end());
+			s.erase(std::unique(s.begin(), s.end()), s.end());
+
+			bool was_compacting = compacting.isCompacting();
+			plain.compute(s, true);
+			compacting.compute(s, true);
+			passes += was_compacting && compacting.isCompacting() == false;
+			mismatches += plain.getPredictiveCells() != compacting.getPredictiveCells();
+		}
+	}
+	CHECK(passes > 0);
+
+	//Segments learnt from a clean sequence die when it runs backwards, as everything they predict is
+	//punished. With no new synapses allowed no segment takes their ids, so the table has dead entries
+	auto step = [&](const std::vector<UInt>& s) {
+		plain.compute(s, true);
+		compacting.compute(s, true);
+		mismatches += plain.getPredictiveCells() != compacting.getPredictiveCells();
+	};
+	for(int pass=0;pass<5;pass++) {
+		for(const auto& s : second)
+			step(s);
+	}
+	for(auto* tm : {&plain, &compacting}) {
+		tm->setMaxNewSynapseCount(0);
+		tm->setPredictedSegmentDecrement(1);
+	}
+	size_t num_segments = plain.numSegments();
+	for(auto s=second.rbegin();s!=second.rend();s++)
+		step(*s);
+	CHECK(plain.numSegments() < num_segments);
+	CHECK(mismatches == 0);
+	CHECK(compacting.numSynapses() == plain.numSynapses());
+	CHECK(compacting.numSegments() == plain.numSegments());
+
+	//A full pass leaves no holes and gives the freed memory back. The first loop finishes the pass
+	//in progress, whose pool phase may already be over
+	while(compacting.compact(std::chrono::microseconds(20)) == false);
+	while(compacting.compact(std::chrono::microseconds(20)) == false);
+	CHECK(compacting.poolHoles() == 0);
+	CHECK(compacting.memoryUsage() < plain.memoryUsage());
+
+	//Learning goes on from the moved segments exactly as from the original ones
+	for(auto* tm : {&plain, &compacting}) {
+		tm->setMaxNewSynapseCount(20);
+		tm->setPredictedSegmentDecrement(0);
+	}
+	mismatches = 0;
+	for(int pass=0;pass<6;pass++) {
+		for(const auto& s : pass%2 == 0 ? first : second)
+			step(s);
+	}
+	CHECK(mismatches == 0);
+	CHECK(compacting.numSegments() == plain.numSegments());
+}
+
+//The compile-time and runtime cells per column take the same path and must agree with a plain
+//division per cell
+void testCellsToColumns()
+{
+	std::mt19937 rng(11);
+	for(size_t cells_per_column : {1, 3, 8, 12, 32, 100}) {
+		std::vector<UInt> cells;
+		for(UInt c=0;c<200*cells_per_column;c++) {
+			if(rng()%7 == 0)
+				cells.push_back(c);
+		}
+		std::vector<UInt> expected;
+		for(auto c : cells) {
+			if(expected.empty() || expected.back() != c/cells_per_column)
+				expected.push_back(c/cells_per_column);
+		}
+
+		std::vector<UInt> columns = {1000};
+		HTM::cellsToColumns(cells, cells_per_column, columns);
+		CHECK(columns == expected);
+		HTM::PackedSDR bits(200);
+		bits.set(199);
+		HTM::cellsToColumns(cells, cells_per_column, bits);
+		std::vector<UInt> set_bits;
+		for(UInt i=0;i<bits.size();i++) {
+			if(bits.test(i))
+				set_bits.push_back(i);
+		}
+		CHECK(set_bits == expected);
+	}
+
+	std::vector<UInt> columns;
+	HTM::cellsToColumns<8>({0, 3, 9, 17, 23}, columns);
+	CHECK((columns == std::vector<UInt>{0, 1, 2}));
+}
+
+//Builds n random patterns of num_bits bits with num_active bits each
+static std::vector<HTM::PackedSDR> randomPatterns(size_t n, size_t num_bits, size_t num_active, unsigned int seed)
+{
+	std::vector<HTM::PackedSDR> patterns;
+	for(const auto& bits : makeSequence(n, num_bits, num_active, seed)) {
+		HTM::PackedSDR p(num_bits);
+		for(auto i : bits)
+			p.set(i);
+		patterns.push_back(p);
+	}
+	return patterns;
+}
+
+//The sparse anomaly score has to match the dense one on the same columns and predictions, and be 0
+//instead of NaN without active columns
+void testSparseAnomaly()
+{
+	const size_t num_columns = 64, cells_per_column = 4;
+	std::mt19937 rng(11);
+	std::bernoulli_distribution active(0.2), predictive(0.05);
+	for(int trial=0;trial<50;trial++) {
+		std::vector<UInt> columns, cells;
+		xt::xarray<bool> input = xt::zeros<bool>({num_columns});
+		xt::xarray<bool> prediction = xt::zeros<bool>({num_columns});
+		for(UInt c=0;c<num_columns;c++) {
+			if(active(rng)) {
+				columns.push_back(c);
+				input[c] = true;
+			}
+		}
+		for(UInt c=0;c<num_columns*cells_per_column;c++) {
+			if(predictive(rng)) {
+				cells.push_back(c);
+				prediction[c/cells_per_column] = true;
+			}
+		}
+		if(columns.empty())
+			continue;
+		float sparse = HTM::anomaly(columns, cells, cells_per_column);
+		CHECK(std::abs(sparse - HTM::anomaly(input, prediction)) < 1e-6f);
+	}
+	CHECK(HTM::anomaly(std::vector<UInt>(), std::vector<UInt>{0, 5}, cells_per_column) == 0);
+}
+
+void testSDRIndex()
+{
+	auto patterns = randomPatterns(200, 2048, 40, 9);
+	HTM::SDRIndex index(2048);
+	for(size_t i=0;i<patterns.size();i++)
+		index.insert(i, patterns[i]);
+	CHECK(index.size() == patterns.size());
+
+	//Every stored pattern is its own best match
+	for(size_t i=0;i<patterns.size();i++) {
+		auto res = index.query(patterns[i], 3);
+		CHECK(res.size() >= 1 && res[0].first == i && res[0].second == 40);
+	}
+
+	//A pattern with a few of its bits moved is still found
+	std::vector<UInt> bits;
+	for(UInt i=0;i<2048;i++) {
+		if(patterns[17].test(i))
+			bits.push_back(i);
+	}
+	HTM::PackedSDR noisy(2048);
+	for(size_t i=0;i<bits.size();i++)
+		noisy.set(i < 4 ? (bits[i]+1000)%2048 : bits[i]);
+	auto res = index.query(noisy, 1);
+	CHECK(res.size() == 1 && res[0].first == 17);
+
+	index.remove(17);
+	CHECK(index.size() == patterns.size()-1);
+	for(const auto& r : index.query(patterns[17], 10))
+		CHECK(r.first != 17);
+
+	//Inserting an id again replaces its pattern
+	index.insert(3, patterns[17]);
+	res = index.query(patterns[17], 1);
+	CHECK(res.size() == 1 && res[0].first == 3);
+	CHECK(index.size() == patterns.size()-1);
+}
+
+//The packed paths read a fixed number of words from the query, so a wrong size has to throw
+void testSDRClassiferBadSize()
+{
+	HTM::SDRClassifer classifier(4, {64});
+	xt::xarray<bool> good = xt::zeros<bool>({64});
+	xt::xarray<bool> bad = xt::zeros<bool>({32});
+	classifier.add(1, good);
+	CHECK(throwsRuntimeError([&](){classifier.add(1, bad);}));
+	CHECK(throwsRuntimeError([&](){classifier.compute(bad);}));
+	CHECK(throwsRuntimeError([&](){classifier.compute(bad, 0.25f);}));
+	CHECK(classifier.compute(good) == 0);
+
+	CHECK(throwsRuntimeError([&](){classifier.computeScores(bad);}));
+	CHECK(throwsRuntimeError([&](){classifier.computeTopK(bad, 2);}));
+	classifier.enableIndex();
+	CHECK(throwsRuntimeError([&](){classifier.computeApprox(bad);}));
+	CHECK(throwsRuntimeError([&](){classifier.patternIndex()->query(HTM::PackedSDR(32), 1);}));
+	CHECK(classifier.computeTopK(good, 2).size() == 2);
+}
+
+//Deterministic stand-in for a position encoder
+struct HashEncoder
+{
+	SDR encode(glm::vec2 pos) const
+	{
+		SDR res = xt::zeros<bool>({256});
+		uint64_t h = std::hash<float>()(pos.x)*31 + std::hash<float>()(pos.y);
+		for(int i=0;i<8;i++) {
+			h = h*6364136223846793005ULL + 1442695040888963407ULL;
+			res[(h>>33)%256] = true;
+		}
+		return res;
+	}
+};
+
+//Readers racing with inserts and evictions on a tiny table must never see a torn entry
+void testCachedEncoder()
+{
+	HashEncoder base;
+	CachedEncoder<HashEncoder> encoder(base, 1.f, 16);
+	glm::vec2 p(3.5f, -2.25f);
+	auto first = encoder.encodeSparse(p);
+	CHECK(first == HTM::sparsify(base.encode(glm::vec2(3, -3))));
+	CHECK(encoder.encodeSparse(p) == first);
+	CHECK(encoder.hits() == 1 && encoder.misses() == 1);
+
+	//Grid points 2^32 apart must not share a cache entry
+	auto near = encoder.encodeSparse(glm::vec2(0.5f, -2.25f));
+	auto far = encoder.encodeSparse(glm::vec2(4294967296.f, -2.25f));
+	CHECK(far == HTM::sparsify(base.encode(glm::vec2(4294967296.f, -3))));
+	CHECK(far != near);
+	CHECK(throwsRuntimeError([&](){encoder.encodeSparse(glm::vec2(std::numeric_limits<float>::quiet_NaN(), 0));}));
+	CHECK(throwsRuntimeError([&](){encoder.encodeSparse(glm::vec2(0, std::numeric_limits<float>::infinity()));}));
+	CHECK(throwsRuntimeError([&](){encoder.encodeSparse(glm::vec2(1e30f, 0));}));
+
+	std::atomic<size_t> mismatches{0};
+	std::vector<std::thread> threads;
+	for(int t=0;t<4;t++) {
+		threads.emplace_back([&, t](){
+			std::mt19937 rng(t);
+			for(int i=0;i<20000;i++) {
+				glm::vec2 pos((float)(rng()%64), (float)(rng()%64));
+				if(encoder.encodeSparse(pos) != HTM::sparsify(base.encode(pos)))
+					mismatches++;
+			}
+		});
+	}
+	for(auto& t : threads)
+		t.join();
+	CHECK(mismatches == 0);
+	CHECK(encoder.hits() > 0);
+}
+
+void testSPSCQueue()
+{
+	HTM::SPSCQueue<int> queue(4);
+	CHECK(queue.capacity() == 4);
+	for(int i=0;i<4;i++) {
+		int v = i;
+		CHECK(queue.tryPush(v));
+	}
+	int v = 4;
+	CHECK(queue.tryPush(v) == false);
+	for(int i=0;i<4;i++)
+		CHECK(queue.pop() == i);
+	CHECK(queue.tryPop(v) == false);
+
+	//Items arrive complete and in order across threads
+	const int n = 100000;
+	std::thread producer([&](){
+		for(int i=0;i<n;i++)
+			queue.push(i);
+	});
+	bool in_order = true;
+	for(int i=0;i<n;i++)
+		in_order &= queue.pop() == i;
+	producer.join();
+	CHECK(in_order);
+
+	//Stop-aware waits give up instead of blocking forever
+	std::atomic<bool> stop{false};
+	std::thread stopper([&](){
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		stop = true;
+	});
+	CHECK(queue.pop(v, stop) == false);
+	stopper.join();
+}
+
+void testThreadPool()
+{
+	HTM::ThreadPool pool(4);
+	CHECK(pool.size() == 4);
+	std::atomic<int> sum{0};
+	std::vector<std::future<void>> futures;
+	for(int i=0;i<1000;i++)
+		futures.push_back(pool.submit([&sum, i](){sum += i;}));
+	for(auto& f : futures)
+		f.get();
+	CHECK(sum == 999*1000/2);
+
+	bool thrown = false;
+	try {
+		pool.submit([](){throw std::runtime_error("task failed");}).get();
+	}
+	catch(std::runtime_error&) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	//parallelFor visits every index exactly once, also with a grain that does not divide the range
+	std::vector<std::atomic<int>> visits(1001);
+	HTM::parallelFor(0, visits.size(), 7, [&](size_t begin, size_t end) {
+		for(size_t i=begin;i<end;i++)
+			visits[i]++;
+	}, pool);
+	bool once = true;
+	for(auto& v : visits)
+		once &= v == 1;
+	CHECK(once);
+
+	thrown = false;
+	try {
+		HTM::parallelFor(0, 100, 1, [](size_t begin, size_t) {
+			if(begin != 0)
+				throw std::runtime_error("chunk failed");
+		}, pool);
+	}
+	catch(std::runtime_error&) {
+		thrown = true;
+	}
+	CHECK(thrown);
+}
+
+int main()
+{
+	std::vector<std::pair<std::string, std::function<void()>>> tests = {
+		{"GridCellEncoder2D modules", testGridCellEncoderModules},
+		{"GridCellEncoderND lattice wrap", testGridCellLatticeWrap},
+		{"GridCellEncoder2D lattice wrap", testGridCell2DLatticeWrap},
+		{"LocEncoder2D", testLocEncoder2D},
+		{"RandomDistributedScalarEncoder", testRandomDistributedScalarEncoder},
+		{"SpatialPooler sparse input with a bad index", testSpatialPoolerSparseBadIndex},
+		{"TemporalPooler sparse input with a bad index", testTemporalPoolerSparseBadIndex},
+		{"PackedSpatialPooler stimulus threshold", testPackedSpatialPoolerStimulusThreshold},
+		{"PackedSpatialPooler parallel matches serial", testPackedSpatialPoolerParallel},
+		{"TemporalMemory frozen inference", testFrozenInference},
+		{"TemporalMemory learning after frozen inference", testFrozenResume},
+		{"CompactTemporalMemory against nupic", testCompactTemporalMemory},
+		{"CompactTemporalMemory compaction", testCompactTemporalMemoryCompaction},
+		{"cellsToColumns", testCellsToColumns},
+		{"Sparse anomaly", testSparseAnomaly},
+		{"SDRIndex", testSDRIndex},
+		{"SDRClassifer bad input size", testSDRClassiferBadSize},
+		{"CachedEncoder", testCachedEncoder},
+		{"SPSCQueue", testSPSCQueue},
+		{"ThreadPool", testThreadPool},
+	};
+
+	for(const auto& test : tests) {
+		int before = failures;
+		test.second();
+		std::cout << (failures == before ? "PASS " : "FAIL ") << test.first << std::endl;
+	}
+	return failures == 0 ? 0 : 1;
+}